@@ -23,21 +23,215 @@
 #include "common.h"
 
 #define MAXSTACK 1000 /* Arbitrary stack size limit to check for recursion */
+#define MAXDEPTH 100 /* Nesting limit for incrementally built documents */
+#define KEYSIZE 16 /* Buffer size for array indices */
 
-static int m_append(lua_State *L) {
-	bson_t *bson = checkBSON(L, 1);
+typedef struct {
+	int nerr;
+	int depth;
+	const void *path[MAXSTACK]; /* Tables being converted (to check for circular references) */
+} Encoder;
+
+typedef struct {
+	int depth; /* Number of open subdocuments */
+	struct {
+		bool array;
+		uint32_t index; /* Next array index */
+	} levels[MAXDEPTH + 1];
+	bson_t docs[MAXDEPTH]; /* Open subdocuments (must stay in place until closed) */
+} Builder;
+
+typedef struct {
+	Builder *builder; /* Allocated on first 'begin' */
+	bool borrowed; /* Data is owned by a string anchored in uservalue */
+} State;
+
+#define getState(bson) ((State *)((bson) + 1)) /* Stored right after BSON document */
+#define getBuilder(bson) (getState(bson)->builder)
+
+static bool appendValue(lua_State *L, int idx, Encoder *enc, bson_t *bson, const char *key, size_t klen);
+
+static bson_t *newDocument(lua_State *L) {
+	bson_t *bson = lua_newuserdata(L, sizeof *bson + sizeof(State));
+	memset(getState(bson), 0, sizeof(State));
+	return bson;
+}
+
+static bson_t *checkDocument(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_BSON);
+}
+
+static bool isComplete(const bson_t *bson) {
+	Builder *b = getBuilder(bson);
+	return !b || !b->depth;
+}
+
+static bool isReadOnly(const bson_t *bson) {
+	return getState(bson)->borrowed;
+}
+
+static bson_t *checkTarget(lua_State *L, const char **key, size_t *klen, char *buf) {
+	bson_t *bson = checkDocument(L, 1);
+	Builder *b = getBuilder(bson);
+	int depth = b ? b->depth : 0;
+	luaL_argcheck(L, !isReadOnly(bson), 1, "read-only document");
+	if (depth && b->levels[depth].array && lua_isnoneornil(L, 2)) *klen = bson_uint32_to_string(b->levels[depth].index, key, buf, KEYSIZE); /* Next array index */
+	else *key = luaL_checklstring(L, 2, klen);
+	return depth ? &b->docs[depth - 1] : bson;
+}
+
+static void nextIndex(const bson_t *bson) {
+	Builder *b = getBuilder(bson);
+	if (b && b->depth) ++b->levels[b->depth].index;
+}
+
+static void appendArg(lua_State *L, int idx, bson_t *bson, const char *key, size_t klen) {
+	Encoder enc;
+	bson_t doc;
+	bool res;
+	enc.nerr = 0;
+	enc.depth = 0;
+	luaL_checkany(L, idx);
+	if (luaL_callmeta(L, idx, "__toBSON")) lua_replace(L, idx); /* Transform value */
+	if (!lua_istable(L, idx) && testBSON(L, idx) != bson) res = appendValue(L, idx, &enc, bson, key, klen);
+	else { /* Tables can fail halfway, so they are converted separately to keep 'bson' intact */
+		bson_init(&doc);
+		if ((res = appendValue(L, idx, &enc, &doc, key, klen))) bson_concat(bson, &doc);
+		bson_destroy(&doc);
+	}
+	if (res) return;
+	lua_concat(L, enc.nerr);
+	luaL_argerror(L, idx, lua_tostring(L, -1));
+}
+
+static int appendTyped(lua_State *L, bson_type_t type) {
+	char buf[KEYSIZE];
+	const char *key;
 	size_t klen;
-	const char *key = luaL_checklstring(L, 2, &klen);
-	bson_value_t value;
-	toBSONValue(L, 3, &value);
-	bson_append_value(bson, key, klen, &value);
-	bson_value_destroy(&value);
+	bson_t *bson = checkTarget(L, &key, &klen, buf);
+	switch (type) {
+		case BSON_TYPE_BOOL:
+			luaL_checktype(L, 3, LUA_TBOOLEAN);
+			bson_append_bool(bson, key, klen, lua_toboolean(L, 3));
+			break;
+		case BSON_TYPE_INT32:
+			bson_append_int32(bson, key, klen, checkInt32(L, 3));
+			break;
+		case BSON_TYPE_INT64:
+			bson_append_int64(bson, key, klen, checkInt64(L, 3));
+			break;
+		case BSON_TYPE_DOUBLE:
+			bson_append_double(bson, key, klen, luaL_checknumber(L, 3));
+			break;
+		case BSON_TYPE_UTF8: {
+			size_t len;
+			const char *str = luaL_checklstring(L, 3, &len);
+			bson_append_utf8(bson, key, klen, str, len);
+			break;
+		}
+		case BSON_TYPE_BINARY: {
+			size_t len;
+			const char *str = luaL_checklstring(L, 3, &len);
+			bson_append_binary(bson, key, klen, luaL_optinteger(L, 4, 0), (const uint8_t *)str, len);
+			break;
+		}
+		case BSON_TYPE_OID:
+			bson_append_oid(bson, key, klen, checkObjectID(L, 3));
+			break;
+		case BSON_TYPE_DATE_TIME:
+			bson_append_date_time(bson, key, klen, checkInt64(L, 3));
+			break;
+		case BSON_TYPE_NULL:
+			bson_append_null(bson, key, klen);
+			break;
+		default: /* Any */
+			appendArg(L, 3, bson, key, klen);
+			break;
+	}
+	nextIndex(lua_touserdata(L, 1));
+	return 0;
+}
+
+static int beginChild(lua_State *L, bool array) {
+	char buf[KEYSIZE];
+	const char *key;
+	size_t klen;
+	bson_t *bson = checkTarget(L, &key, &klen, buf);
+	bson_t *root = lua_touserdata(L, 1);
+	Builder *b = getBuilder(root);
+	if (!b) b = getBuilder(root) = bson_malloc0(sizeof *b);
+	luaL_argcheck(L, b->depth < MAXDEPTH, 1, "too many nested documents");
+	if (array) bson_append_array_begin(bson, key, klen, &b->docs[b->depth]);
+	else bson_append_document_begin(bson, key, klen, &b->docs[b->depth]);
+	nextIndex(root);
+	++b->depth;
+	b->levels[b->depth].array = array;
+	b->levels[b->depth].index = 0;
+	return 0;
+}
+
+static int endChild(lua_State *L, bool array) {
+	bson_t *bson = checkDocument(L, 1);
+	Builder *b = getBuilder(bson);
+	luaL_argcheck(L, b && b->depth && b->levels[b->depth].array == array, 1, array ? "no open array" : "no open document");
+	bson = --b->depth ? &b->docs[b->depth - 1] : bson;
+	if (array) bson_append_array_end(bson, &b->docs[b->depth]);
+	else bson_append_document_end(bson, &b->docs[b->depth]);
 	return 0;
 }
 
+static int m_append(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_EOD);
+}
+
+static int m_appendBinary(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_BINARY);
+}
+
+static int m_appendBool(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_BOOL);
+}
+
+static int m_appendDateTime(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_DATE_TIME);
+}
+
+static int m_appendDouble(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_DOUBLE);
+}
+
+static int m_appendInt32(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_INT32);
+}
+
+static int m_appendInt64(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_INT64);
+}
+
+static int m_appendNull(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_NULL);
+}
+
+static int m_appendObjectID(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_OID);
+}
+
+static int m_appendUtf8(lua_State *L) {
+	return appendTyped(L, BSON_TYPE_UTF8);
+}
+
+static int m_beginArray(lua_State *L) {
+	return beginChild(L, true);
+}
+
+static int m_beginDocument(lua_State *L) {
+	return beginChild(L, false);
+}
+
 static int m_concat(lua_State *L) {
 	bson_t *bson = checkBSON(L, 1);
 	bson_t *value = castBSON(L, 2);
+	luaL_argcheck(L, !isReadOnly(bson), 1, "read-only document");
 	luaL_argcheck(L, value != bson, 2, "invalid value");
 	bson_concat(bson, value);
 	return 0;
@@ -45,10 +239,23 @@ static int m_concat(lua_State *L) {
 
 static int m_data(lua_State *L) {
 	bson_t *bson = checkBSON(L, 1);
+	if (getState(bson)->borrowed) { /* Return original string */
+		lua_getuservalue(L, 1);
+		lua_rawgeti(L, -1, 1);
+		return 1;
+	}
 	lua_pushlstring(L, (const char *)bson_get_data(bson), bson->len);
 	return 1;
 }
 
+static int m_endArray(lua_State *L) {
+	return endChild(L, true);
+}
+
+static int m_endDocument(lua_State *L) {
+	return endChild(L, false);
+}
+
 static int m_find(lua_State *L) {
 	bson_t *bson = checkBSON(L, 1);
 	const char *key = luaL_checkstring(L, 2);
@@ -56,8 +263,34 @@ static int m_find(lua_State *L) {
 	return 1;
 }
 
+static bool isArray(const bson_t *bson);
+
+static int pack(lua_State *L, bool cbor) {
+	bson_t *bson = checkBSON(L, 1);
+	Packer p;
+	initPacker(L, &p, cbor);
+	appendPacked(&p, bson_get_data(bson), bson->len, isArray(bson));
+	luaL_pushresult(&p.b);
+	return 1;
+}
+
+static int m_toCBOR(lua_State *L) {
+	return pack(L, true);
+}
+
+static int m_toMsgPack(lua_State *L) {
+	return pack(L, false);
+}
+
 static int m_value(lua_State *L) {
-	pushBSON(L, checkBSON(L, 1), 2);
+	bson_t *bson = checkBSON(L, 1);
+	unpackBSON(L, bson, 2, toUnpackOptions(L, 3));
+	return 1;
+}
+
+static int m_view(lua_State *L) {
+	bson_t *bson = checkBSON(L, 1);
+	pushBSONView(L, bson, getState(bson)->borrowed ? 1 : 0); /* Borrowed data is immutable */
 	return 1;
 }
 
@@ -80,17 +313,36 @@ static int m__eq(lua_State *L) {
 }
 
 static int m__gc(lua_State *L) {
-	bson_destroy(checkBSON(L, 1));
+	bson_t *bson = checkDocument(L, 1);
+	bson_free(getBuilder(bson));
+	bson_destroy(bson);
 	unsetType(L);
 	return 0;
 }
 
 static const luaL_Reg funcs[] = {
 	{"append", m_append},
+	{"appendBinary", m_appendBinary},
+	{"appendBool", m_appendBool},
+	{"appendDateTime", m_appendDateTime},
+	{"appendDouble", m_appendDouble},
+	{"appendInt32", m_appendInt32},
+	{"appendInt64", m_appendInt64},
+	{"appendNull", m_appendNull},
+	{"appendObjectID", m_appendObjectID},
+	{"appendUtf8", m_appendUtf8},
+	{"beginArray", m_beginArray},
+	{"beginDocument", m_beginDocument},
+	{"compress", compressBSON},
 	{"concat", m_concat},
 	{"data", m_data},
+	{"endArray", m_endArray},
+	{"endDocument", m_endDocument},
 	{"find", m_find},
+	{"toCBOR", m_toCBOR},
+	{"toMsgPack", m_toMsgPack},
 	{"value", m_value},
+	{"view", m_view},
 	{"__tostring", m__tostring},
 	{"__len", m__len},
 	{"__eq", m__eq},
@@ -98,7 +350,7 @@ static const luaL_Reg funcs[] = {
 	{0, 0}
 };
 
-static bool error(lua_State *L, int *nerr, const char *fmt, ...) {
+static bool error(lua_State *L, Encoder *enc, const char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
 #if LUA_VERSION_NUM >= 504
@@ -106,7 +358,7 @@ static bool error(lua_State *L, int *nerr, const char *fmt, ...) {
 #endif
 	lua_pushvfstring(L, fmt, ap);
 	va_end(ap);
-	lua_insert(L, -(++(*nerr)));
+	lua_insert(L, -(++enc->nerr));
 	return false;
 }
 
@@ -150,7 +402,7 @@ static bool initBSON(const char *str, size_t len, bson_t *bson, bson_error_t *er
 	return false;
 }
 
-static bool appendBSONType(lua_State *L, bson_type_t type, int idx, int *nerr, bson_t *bson, const char *key, size_t klen) {
+static bool appendBSONType(lua_State *L, bson_type_t type, int idx, Encoder *enc, bson_t *bson, const char *key, size_t klen) {
 	int top = lua_gettop(L);
 	unpackParams(L, idx);
 	switch (type) {
@@ -205,7 +457,7 @@ static bool appendBSONType(lua_State *L, bson_type_t type, int idx, int *nerr, b
 			break;
 		default:
 		error:
-			return error(L, nerr, "invalid parameters for BSON type %d", type);
+			return error(L, enc, "invalid parameters for BSON type %d", type);
 	}
 	lua_settop(L, top);
 	return true;
@@ -286,12 +538,21 @@ static lua_Integer getArrayLength(lua_State *L, int idx) {
 	return len;
 }
 
-static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, lua_Integer len);
+static bool appendTable(lua_State *L, int idx, Encoder *enc, bson_t *bson, lua_Integer len);
+static bool appendSchema(lua_State *L, int idx, int sidx, Encoder *enc, bson_t *bson);
 
-static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, const char *key, size_t klen) {
+static bool appendValue(lua_State *L, int idx, Encoder *enc, bson_t *bson, const char *key, size_t klen) {
 	if (luaL_getmetafield(L, idx, "__toBSON")) { /* Transform value */
+		if (testSchema(L, -1)) { /* Encode value according to schema */
+			bson_t doc;
+			bson_append_document_begin(bson, key, klen, &doc);
+			if (!appendSchema(L, idx, lua_gettop(L), enc, &doc)) return false;
+			bson_append_document_end(bson, &doc);
+			lua_pop(L, 1);
+			return true;
+		}
 		lua_pushvalue(L, idx);
-		if (lua_pcall(L, 1, 1, 0)) return error(L, nerr, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "(error object is not a string)");
+		if (lua_pcall(L, 1, 1, 0)) return error(L, enc, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "(error object is not a string)");
 		lua_replace(L, idx);
 	}
 	switch (lua_type(L, idx)) {
@@ -321,18 +582,18 @@ static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 			lua_Integer len;
 			bson_t doc;
 			if (luaL_getmetafield(L, idx, "__type")) {
-				if (!appendBSONType(L, lua_tointeger(L, -1), idx, nerr, bson, key, klen)) return false;
+				if (!appendBSONType(L, lua_tointeger(L, -1), idx, enc, bson, key, klen)) return false;
 				lua_pop(L, 1);
 				break;
 			}
 			len = getArrayLength(L, idx);
 			if (len != -1) {
 				bson_append_array_begin(bson, key, klen, &doc);
-				if (!appendTable(L, idx, ridx, nerr, &doc, len)) return false;
+				if (!appendTable(L, idx, enc, &doc, len)) return false;
 				bson_append_array_end(bson, &doc);
 			} else {
 				bson_append_document_begin(bson, key, klen, &doc);
-				if (!appendTable(L, idx, ridx, nerr, &doc, len)) return false;
+				if (!appendTable(L, idx, enc, &doc, len)) return false;
 				bson_append_document_end(bson, &doc);
 			}
 			break;
@@ -340,6 +601,11 @@ static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 		case LUA_TUSERDATA: {
 			bson_t *doc;
 			bson_oid_t *oid;
+			bson_value_t *val;
+			if ((val = testBSONType(L, idx))) {
+				bson_append_value(bson, key, klen, val);
+				break;
+			}
 			if ((doc = testBSON(L, idx))) {
 				if (isArray(doc)) bson_append_array(bson, key, klen, doc);
 				else bson_append_document(bson, key, klen, doc);
@@ -351,24 +617,22 @@ static bool appendValue(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 			}
 		} /* Fall through */
 		default:
-			return error(L, nerr, "%s unexpected", typeName(L, idx));
+			return error(L, enc, "%s unexpected", typeName(L, idx));
 	}
 	return true;
 }
 
-static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson, lua_Integer len) {
+static bool appendTable(lua_State *L, int idx, Encoder *enc, bson_t *bson, lua_Integer len) {
 	const char *key;
 	size_t klen;
-	int top = lua_gettop(L);
-	if (top >= MAXSTACK) return error(L, nerr, "recursion detected");
-	if (lua_getmetatable(L, idx)) return error(L, nerr, "table with metatable unexpected");
-	lua_pushvalue(L, idx);
-	lua_rawget(L, ridx);
-	if (lua_toboolean(L, -1)) return error(L, nerr, "circular reference detected");
-	lua_pushvalue(L, idx);
-	lua_pushboolean(L, 1);
-	lua_rawset(L, ridx);
-	lua_settop(L, top);
+	const void *ptr = lua_topointer(L, idx);
+	int d, top = lua_gettop(L);
+	if (top >= MAXSTACK) return error(L, enc, "recursion detected");
+	if (lua_getmetatable(L, idx)) return error(L, enc, "table with metatable unexpected");
+	for (d = 0; d < enc->depth; ++d) {
+		if (enc->path[d] == ptr) return error(L, enc, "circular reference detected");
+	}
+	enc->path[enc->depth++] = ptr;
 	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
 	if (len != -1) { /* As array */
 		char buf[64];
@@ -376,25 +640,129 @@ static bool appendTable(lua_State *L, int idx, int ridx, int *nerr, bson_t *bson
 		for (i = 0; i < len; ++i) {
 			lua_rawgeti(L, idx, i + 1);
 			klen = bson_uint32_to_string(i, &key, buf, sizeof buf);
-			if (!appendValue(L, top + 1, ridx, nerr, bson, key, klen)) return error(L, nerr, "[%d] => ", i + 1);
+			if (!appendValue(L, top + 1, enc, bson, key, klen)) return error(L, enc, "[%d] => ", i + 1);
 			lua_pop(L, 1);
 		}
 	} else { /* As document */
 		for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
-			if (lua_type(L, top + 1) != LUA_TSTRING) return error(L, nerr, "string index expected, got %s", typeName(L, top + 1));
+			if (lua_type(L, top + 1) != LUA_TSTRING) return error(L, enc, "string index expected, got %s", typeName(L, top + 1));
 			key = lua_tolstring(L, top + 1, &klen);
-			if (!appendValue(L, top + 2, ridx, nerr, bson, key, klen)) return error(L, nerr, "[\"%s\"] => ", key);
+			if (!appendValue(L, top + 2, enc, bson, key, klen)) return error(L, enc, "[\"%s\"] => ", key);
+		}
+	}
+	--enc->depth;
+	return true;
+}
+
+static bool appendField(lua_State *L, int idx, int uidx, Encoder *enc, bson_t *bson, const Schema *schema, int i) {
+	const SchemaField *field = &schema->fields[i];
+	const char *key = field->key;
+	size_t klen = field->klen;
+	bson_value_t *value = lua_type(L, idx) == LUA_TUSERDATA ? testBSONType(L, idx) : 0;
+	lua_Integer n;
+	if (value && value->value_type == field->type) { /* BSON type instance, e.g. mongo.Int64 */
+		bson_append_value(bson, key, klen, value);
+		return true;
+	}
+	switch (field->type) {
+		case BSON_TYPE_BOOL:
+			if (!lua_isboolean(L, idx)) break;
+			bson_append_bool(bson, key, klen, lua_toboolean(L, idx));
+			return true;
+		case BSON_TYPE_INT32:
+			if (!isInteger(L, idx, &n) || !isInt32(n)) break;
+			bson_append_int32(bson, key, klen, n);
+			return true;
+		case BSON_TYPE_INT64:
+			if (!isInteger(L, idx, &n)) break;
+			bson_append_int64(bson, key, klen, n);
+			return true;
+		case BSON_TYPE_DOUBLE:
+			if (lua_type(L, idx) != LUA_TNUMBER) break;
+			bson_append_double(bson, key, klen, lua_tonumber(L, idx));
+			return true;
+		case BSON_TYPE_UTF8: {
+			size_t len;
+			const char *str;
+			if (lua_type(L, idx) != LUA_TSTRING) break;
+			str = lua_tolstring(L, idx, &len);
+			bson_append_utf8(bson, key, klen, str, len);
+			return true;
 		}
+		case BSON_TYPE_OID: {
+			bson_oid_t *oid = testObjectID(L, idx);
+			if (!oid) break;
+			bson_append_oid(bson, key, klen, oid);
+			return true;
+		}
+		case BSON_TYPE_DATE_TIME:
+			if (!isInteger(L, idx, &n)) break;
+			bson_append_date_time(bson, key, klen, n);
+			return true;
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY: {
+			bool array = field->type == BSON_TYPE_ARRAY;
+			bson_t doc;
+			lua_rawgeti(L, uidx, schema->n + i + 1);
+			if (!lua_isnil(L, -1)) { /* Nested schema */
+				bson_append_document_begin(bson, key, klen, &doc);
+				if (!appendSchema(L, idx, lua_gettop(L), enc, &doc)) return false;
+				bson_append_document_end(bson, &doc);
+				lua_pop(L, 1);
+				return true;
+			}
+			lua_pop(L, 1);
+			if (!lua_istable(L, idx) || lua_getmetatable(L, idx)) { /* BSON document or '__toBSON' */
+				lua_settop(L, idx);
+				return appendValue(L, idx, enc, bson, key, klen);
+			}
+			if (array) {
+				lua_Integer len = getArrayLength(L, idx);
+				bson_append_array_begin(bson, key, klen, &doc);
+				if (!appendTable(L, idx, enc, &doc, len != -1 ? len : (lua_Integer)lua_rawlen(L, idx))) return false;
+				bson_append_array_end(bson, &doc);
+			} else {
+				bson_append_document_begin(bson, key, klen, &doc);
+				if (!appendTable(L, idx, enc, &doc, -1)) return false;
+				bson_append_document_end(bson, &doc);
+			}
+			return true;
+		}
+		default: /* Any */
+			return appendValue(L, idx, enc, bson, key, klen);
+	}
+	return error(L, enc, "%s expected, got %s", field->tname, typeName(L, idx));
+}
+
+static bool appendSchema(lua_State *L, int idx, int sidx, Encoder *enc, bson_t *bson) {
+	const Schema *schema = lua_touserdata(L, sidx);
+	int i, top = lua_gettop(L);
+	if (top >= MAXSTACK) return error(L, enc, "recursion detected");
+	if (!lua_istable(L, idx)) return error(L, enc, "table expected, got %s", typeName(L, idx));
+	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
+	lua_getuservalue(L, sidx); /* Keys and nested schemas */
+	for (i = 0; i < schema->n; ++i) {
+		lua_rawgeti(L, top + 1, i + 1);
+		lua_rawget(L, idx);
+		if (!lua_isnil(L, top + 2) && !appendField(L, top + 2, top + 1, enc, bson, schema, i)) return error(L, enc, "[\"%s\"] => ", schema->fields[i].key);
+		lua_settop(L, top + 1);
 	}
-	lua_pushvalue(L, idx);
-	lua_pushnil(L);
-	lua_rawset(L, ridx);
+	lua_settop(L, top);
 	return true;
 }
 
-static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, bool array);
+static bool appendRoot(lua_State *L, int idx, int sidx, bson_t *bson) {
+	Encoder enc;
+	enc.nerr = 0;
+	enc.depth = 0;
+	if (sidx ? appendSchema(L, idx, sidx, &enc, bson) : appendTable(L, idx, &enc, bson, getArrayLength(L, idx))) return true;
+	lua_concat(L, enc.nerr);
+	return false;
+}
+
+static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, const UnpackOptions *opts, const Projection *node, const Projection *hnode, bool array, int tidx);
 
-static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
+static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx, const UnpackOptions *opts, const Projection *node, const Projection *hnode, int tidx) {
 	switch (bson_iter_type(iter)) {
 		case BSON_TYPE_BOOL:
 			lua_pushboolean(L, bson_iter_bool(iter));
@@ -417,21 +785,23 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 		case BSON_TYPE_DOCUMENT:
 		case BSON_TYPE_ARRAY: {
 			bson_iter_t tmp;
+			bool array = BSON_ITER_HOLDS_ARRAY(iter);
 			check(L, bson_iter_recurse(iter, &tmp));
-			unpackTable(L, &tmp, hidx, BSON_ITER_HOLDS_ARRAY(iter));
+			if (array && !node && opts && opts->arrays && pushVectorFromArray(L, &tmp, opts->arrays)) break;
+			unpackTable(L, &tmp, hidx, opts, node, hnode, array, tidx);
 			break;
 		}
-		case BSON_TYPE_OID:
-			pushObjectID(L, bson_iter_oid(iter));
-			break;
-		case BSON_TYPE_DECIMAL128: {
-			bson_decimal128_t dec;
-			char buf[BSON_DECIMAL128_STRING];
-			check(L, bson_iter_decimal128(iter, &dec));
-			bson_decimal128_to_string(&dec, buf);
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DECIMAL128);
-			lua_pushstring(L, buf);
-			lua_call(L, 1, 1);
+		case BSON_TYPE_OID: {
+			const bson_oid_t *oid = bson_iter_oid(iter);
+			char buf[25];
+			if (!opts || !opts->objectIds) {
+				pushObjectID(L, oid);
+			} else if (opts->objectIds == OID_HEX) {
+				bson_oid_to_string(oid, buf);
+				lua_pushlstring(L, buf, 24);
+			} else {
+				lua_pushlstring(L, (const char *)oid->bytes, sizeof oid->bytes);
+			}
 			break;
 		}
 		case BSON_TYPE_BINARY: {
@@ -439,16 +809,43 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 			uint32_t len;
 			const uint8_t *buf;
 			bson_iter_binary(iter, &subtype, &len, &buf);
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_BINARY);
-			lua_pushlstring(L, (const char *)buf, len);
-			lua_pushinteger(L, subtype);
-			lua_call(L, 2, 1);
+			if (subtype == VECTOR_SUBTYPE && opts && opts->vectors && pushVector(L, buf, len)) break;
+			if (opts && opts->rawBinaries) {
+				lua_pushlstring(L, (const char *)buf, len);
+				break;
+			}
+			pushBSONType(L, bson_iter_value(iter));
 			break;
 		}
+		case BSON_TYPE_DECIMAL128:
+			if (opts && opts->rawDecimals) {
+				bson_decimal128_t dec;
+				char buf[BSON_DECIMAL128_STRING];
+				check(L, bson_iter_decimal128(iter, &dec));
+				bson_decimal128_to_string(&dec, buf);
+				lua_pushstring(L, buf);
+				break;
+			}
+			pushBSONType(L, bson_iter_value(iter));
+			break;
 		case BSON_TYPE_DATE_TIME:
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DATETIME);
-			pushInt64(L, bson_iter_date_time(iter));
-			lua_call(L, 1, 1);
+			if (opts && opts->rawDates) {
+				pushInt64(L, bson_iter_date_time(iter));
+				break;
+			}
+			pushBSONType(L, bson_iter_value(iter));
+			break;
+		case BSON_TYPE_TIMESTAMP:
+			if (opts && opts->rawTimestamps) {
+				uint32_t t, i;
+				bson_iter_timestamp(iter, &t, &i);
+				pushInt64(L, (int64_t)((uint64_t)t << 32 | i));
+				break;
+			}
+			pushBSONType(L, bson_iter_value(iter));
+			break;
+		case BSON_TYPE_REGEX:
+			pushBSONType(L, bson_iter_value(iter));
 			break;
 		case BSON_TYPE_CODE: {
 			uint32_t len;
@@ -470,23 +867,6 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 			lua_call(L, 2, 1);
 			break;
 		}
-		case BSON_TYPE_REGEX: {
-			const char *options;
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_REGEX);
-			lua_pushstring(L, bson_iter_regex(iter, &options));
-			lua_pushstring(L, options);
-			lua_call(L, 2, 1);
-			break;
-		}
-		case BSON_TYPE_TIMESTAMP: {
-			uint32_t t, i;
-			bson_iter_timestamp(iter, &t, &i);
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_TIMESTAMP);
-			pushInt32(L, t);
-			pushInt32(L, i);
-			lua_call(L, 2, 1);
-			break;
-		}
 		case BSON_TYPE_MAXKEY:
 			lua_rawgetp(L, LUA_REGISTRYINDEX, &GLOBAL_MAXKEY);
 			break;
@@ -502,28 +882,151 @@ static void unpackValue(lua_State *L, bson_iter_t *iter, int hidx) {
 	}
 }
 
-static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, bool array) {
-	lua_Integer len = 0;
-	lua_newtable(L);
+static bool selectField(const bson_iter_t *iter, const Projection **node) {
+	const Projection *child;
+	if (!*node) return true; /* All fields */
+	if (!(child = findProjection(*node, bson_iter_key(iter), bson_iter_key_len(iter)))) return false;
+	if (child->all) child = 0;
+	else if (!BSON_ITER_HOLDS_DOCUMENT(iter) && !BSON_ITER_HOLDS_ARRAY(iter)) return false;
+	*node = child;
+	return true;
+}
+
+static void newTable(lua_State *L, const bson_iter_t *iter, const Projection *node, bool array, bool alen) {
+	bson_iter_t tmp = *iter;
+	int n = 0;
+	while (bson_iter_next(&tmp)) {
+		const Projection *child = node;
+		if (selectField(&tmp, &child)) ++n;
+	}
+	if (array) lua_createtable(L, n, alen);
+	else lua_createtable(L, 0, n);
+}
+
+static bool isPlainTable(lua_State *L, int idx) {
+	if (!lua_istable(L, idx)) return false;
+	if (!lua_getmetatable(L, idx)) return true;
+	lua_pop(L, 1);
+	return false;
+}
+
+static const Projection *findHandler(const bson_iter_t *iter, const Projection *hnode) {
+	return hnode ? findProjection(hnode, bson_iter_key(iter), bson_iter_key_len(iter)) : 0;
+}
+
+static void callHandler(lua_State *L, int ref) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	lua_insert(L, -2);
+	lua_call(L, 1, 1); /* Transform value */
+}
+
+static bool hasField(lua_State *L, const bson_iter_t *start, const Projection *node, const Projection *hnode, bool array, bool alen) {
+	const Projection *handler;
+	bson_iter_t iter = *start;
+	char buf[KEYSIZE];
+	const char *key;
+	size_t klen;
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		key = lua_tolstring(L, -1, &klen);
+		if (array) return alen && !strcmp(key, "__array");
+	} else if (array && lua_type(L, -1) == LUA_TNUMBER) {
+		lua_Number d = lua_tonumber(L, -1);
+		lua_Integer i = (lua_Integer)d;
+		if (d != (lua_Number)i || i < 1 || i > UINT32_MAX) return false;
+		klen = bson_uint32_to_string((uint32_t)(i - 1), &key, buf, sizeof buf);
+	} else {
+		return false;
+	}
+	if (!bson_iter_find_w_len(&iter, key, (int)klen) || !selectField(&iter, &node)) return false;
+	return !(handler = findHandler(&iter, hnode)) || handler->handler != HANDLER_SKIP;
+}
+
+static void removeStale(lua_State *L, int idx, const bson_iter_t *start, const Projection *node, const Projection *hnode, bool array, bool alen, lua_Integer n) {
+	lua_Integer m = 0;
+	for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) ++m;
+	if (m == n) return; /* Every key has just been set */
+	for (lua_pushnil(L); lua_next(L, idx);) {
+		lua_pop(L, 1);
+		if (hasField(L, start, node, hnode, array, alen)) continue;
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, idx); /* Clearing fields during traversal is allowed */
+	}
+}
+
+static void unpackTable(lua_State *L, bson_iter_t *iter, int hidx, const UnpackOptions *opts, const Projection *node, const Projection *hnode, bool array, int tidx) {
+	bson_iter_t start = *iter;
+	bool alen = array && !(opts && opts->noArrayLength);
+	lua_Integer len = 0, n = 0;
+	int idx;
+	if (tidx) lua_pushvalue(L, tidx); /* Refill existing table */
+	else newTable(L, iter, node, array, alen);
+	idx = lua_gettop(L);
 	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
 	while (bson_iter_next(iter)) {
-		if (array) lua_pushinteger(L, ++len);
+		const Projection *child = node, *handler;
+		int vidx = 0;
+		if (array) ++len;
+		if (!selectField(iter, &child)) continue; /* Skip unselected fields without decoding them */
+		if ((handler = findHandler(iter, hnode)) && handler->handler == HANDLER_SKIP) continue;
+		if (array) lua_pushinteger(L, len);
 		else lua_pushlstring(L, bson_iter_key(iter), bson_iter_key_len(iter));
-		unpackValue(L, iter, hidx);
-		lua_rawset(L, -3);
+		if (tidx && (BSON_ITER_HOLDS_DOCUMENT(iter) || BSON_ITER_HOLDS_ARRAY(iter))) { /* Reuse nested table */
+			lua_pushvalue(L, -1);
+			lua_rawget(L, idx);
+			if (isPlainTable(L, -1)) vidx = lua_gettop(L);
+			else lua_pop(L, 1);
+		}
+		unpackValue(L, iter, hidx, opts, child, handler, vidx);
+		if (vidx) lua_remove(L, vidx);
+		if (handler && handler->handler > 0) callHandler(L, handler->handler);
+		if (!lua_isnil(L, -1)) ++n;
+		lua_rawset(L, idx);
 	}
-	if (array) {
+	if (alen) {
 		lua_pushinteger(L, len);
-		lua_setfield(L, -2, "__array");
+		lua_setfield(L, idx, "__array");
+		++n;
 	}
-	if (lua_isnil(L, hidx)) return; /* No handler */
+	if (tidx) removeStale(L, idx, &start, node, hnode, array, alen, n);
+	if ((hnode && hnode->handler > 0) || lua_isnil(L, hidx)) return; /* Handler from map is called by caller */
 	lua_pushvalue(L, hidx);
 	lua_insert(L, -2);
 	lua_call(L, 1, 1); /* Transform value */
 }
 
 int newBSON(lua_State *L) {
-	castBSON(L, 1);
+	bson_t *bson;
+	bson_error_t error;
+	const char *str;
+	size_t len;
+	bool borrow = false;
+	int flags = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "borrow");
+		borrow = lua_toboolean(L, -1);
+		flags = toValidateFlags(L, 2);
+		lua_pop(L, 1);
+	}
+	if (!borrow) {
+		bson = castBSON(L, 1);
+		if (flags) checkStatus(L, validateBSON(bson, flags, &error), &error);
+		lua_settop(L, 1);
+		return 1;
+	}
+	if (lua_type(L, 1) != LUA_TSTRING) return typeError(L, 1, "string");
+	str = lua_tolstring(L, 1, &len);
+	luaL_argcheck(L, isBSON(str, len), 1, "BSON data expected");
+	check(L, bson_init_static(bson = newDocument(L), (const uint8_t *)str, len));
+	checkStatus(L, bson_validate_with_error(bson, BSON_VALIDATE_NONE, &error), &error);
+	if (flags) checkStatus(L, validateBSON(bson, flags, &error), &error);
+	getState(bson)->borrowed = true;
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1); /* Anchor string */
+	lua_setuservalue(L, -2);
+	setType(L, TYPE_BSON, funcs);
 	return 1;
 }
 
@@ -531,19 +1034,46 @@ void pushBSON(lua_State *L, const bson_t *bson, int hidx) {
 	if (!bson) { /* Return nil */
 		lua_pushnil(L);
 	} else if (!hidx) { /* Copy object */
-		bson_copy_to(bson, lua_newuserdata(L, sizeof *bson));
+		bson_copy_to(bson, newDocument(L));
 		setType(L, TYPE_BSON, funcs);
 	} else { /* Unpack value */
-		bson_iter_t iter;
-		check(L, bson_iter_init(&iter, bson));
-		lua_pushvalue(L, hidx); /* Ensure handler index is valid */
-		unpackTable(L, &iter, lua_gettop(L), isArray(bson));
-		lua_replace(L, -2);
+		unpackBSON(L, bson, hidx, 0);
+	}
+}
+
+void unpackBSON(lua_State *L, const bson_t *bson, int hidx, const UnpackOptions *opts) {
+	const Projection *hnode = opts ? opts->handlers : 0;
+	bson_iter_t iter;
+	int tidx = 0;
+	if (opts && opts->validate) {
+		bson_error_t error;
+		checkStatus(L, validateBSON(bson, opts->validate, &error), &error);
+	}
+	check(L, bson_iter_init(&iter, bson));
+	lua_pushvalue(L, hidx); /* Ensure handler index is valid */
+	hidx = lua_gettop(L);
+	if (opts && opts->into) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, opts->into);
+		tidx = lua_gettop(L);
 	}
+	unpackTable(L, &iter, hidx, opts, opts ? opts->fields : 0, hnode, isArray(bson), tidx);
+	if (hnode && hnode->handler > 0) callHandler(L, hnode->handler); /* Root handler */
+	lua_replace(L, hidx);
+	lua_settop(L, hidx);
 }
 
 void pushBSONWithSteal(lua_State *L, bson_t *bson) {
-	bson_steal(lua_newuserdata(L, sizeof *bson), bson);
+	bson_steal(newDocument(L), bson);
+	setType(L, TYPE_BSON, funcs);
+}
+
+void pushBSONWithSchema(lua_State *L, int idx, int sidx) {
+	bson_t *bson = newDocument(L);
+	bson_init(bson);
+	if (!appendRoot(L, idx, sidx, bson)) {
+		bson_destroy(bson);
+		luaL_argerror(L, idx, lua_tostring(L, -1));
+	}
 	setType(L, TYPE_BSON, funcs);
 }
 
@@ -573,24 +1103,12 @@ void pushBSONValue(lua_State *L, const bson_value_t *val) {
 		case BSON_TYPE_OID:
 			pushObjectID(L, &val->value.v_oid);
 			break;
-		case BSON_TYPE_DECIMAL128: {
-			char buf[BSON_DECIMAL128_STRING];
-			bson_decimal128_to_string(&val->value.v_decimal128, buf);
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DECIMAL128);
-			lua_pushstring(L, buf);
-			lua_call(L, 1, 1);
-			break;
-		}
+		case BSON_TYPE_DECIMAL128:
 		case BSON_TYPE_BINARY:
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_BINARY);
-			lua_pushlstring(L, (const char *)val->value.v_binary.data, val->value.v_binary.data_len);
-			lua_pushinteger(L, val->value.v_binary.subtype);
-			lua_call(L, 2, 1);
-			break;
 		case BSON_TYPE_DATE_TIME:
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_DATETIME);
-			pushInt64(L, val->value.v_datetime);
-			lua_call(L, 1, 1);
+		case BSON_TYPE_REGEX:
+		case BSON_TYPE_TIMESTAMP:
+			pushBSONType(L, val);
 			break;
 		case BSON_TYPE_CODE:
 			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_JAVASCRIPT);
@@ -604,18 +1122,6 @@ void pushBSONValue(lua_State *L, const bson_value_t *val) {
 			pushBSON(L, &bson, 0);
 			lua_call(L, 2, 1);
 			break;
-		case BSON_TYPE_REGEX:
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_REGEX);
-			lua_pushstring(L, val->value.v_regex.regex);
-			lua_pushstring(L, val->value.v_regex.options);
-			lua_call(L, 2, 1);
-			break;
-		case BSON_TYPE_TIMESTAMP:
-			lua_rawgetp(L, LUA_REGISTRYINDEX, &NEW_TIMESTAMP);
-			pushInt32(L, val->value.v_timestamp.timestamp);
-			pushInt32(L, val->value.v_timestamp.increment);
-			lua_call(L, 2, 1);
-			break;
 		case BSON_TYPE_MAXKEY:
 			lua_rawgetp(L, LUA_REGISTRYINDEX, &GLOBAL_MAXKEY);
 			break;
@@ -643,11 +1149,19 @@ void pushBSONField(lua_State *L, const bson_t *bson, const char *key, bool any)
 }
 
 bson_t *checkBSON(lua_State *L, int idx) {
-	return luaL_checkudata(L, idx, TYPE_BSON);
+	bson_t *bson = checkDocument(L, idx);
+	luaL_argcheck(L, isComplete(bson), idx, "incomplete document");
+	return bson;
+}
+
+bool isBorrowedBSON(const bson_t *bson) {
+	return getState(bson)->borrowed;
 }
 
 bson_t *testBSON(lua_State *L, int idx) {
-	return luaL_testudata(L, idx, TYPE_BSON);
+	bson_t *bson = luaL_testudata(L, idx, TYPE_BSON);
+	luaL_argcheck(L, !bson || isComplete(bson), idx, "incomplete document");
+	return bson;
 }
 
 bson_t *castBSON(lua_State *L, int idx) {
@@ -656,26 +1170,44 @@ bson_t *castBSON(lua_State *L, int idx) {
 	const char *str = lua_tolstring(L, idx, &len);
 	if (str) { /* From string */
 		bson_error_t error;
-		checkStatus(L, initBSON(str, len, bson = lua_newuserdata(L, sizeof *bson), &error), &error);
+		checkStatus(L, initBSON(str, len, bson = newDocument(L), &error), &error);
 	} else { /* From value */
-		int nerr = 0;
 		if (luaL_callmeta(L, idx, "__toBSON")) lua_replace(L, idx); /* Transform value */
 		if ((bson = testBSON(L, idx))) return bson; /* Nothing to do */
 		if (!lua_istable(L, idx)) typeError(L, idx, "string, table or " TYPE_BSON);
-		bson_init(bson = lua_newuserdata(L, sizeof *bson));
-		lua_newtable(L);
-		if (!appendTable(L, idx, lua_gettop(L), &nerr, bson, getArrayLength(L, idx))) {
+		bson_init(bson = newDocument(L));
+		if (!appendRoot(L, idx, 0, bson)) {
 			bson_destroy(bson);
-			lua_concat(L, nerr);
 			luaL_argerror(L, idx, lua_tostring(L, -1));
 		}
-		lua_pop(L, 1);
 	}
 	setType(L, TYPE_BSON, funcs);
 	lua_replace(L, idx);
 	return bson;
 }
 
+bool encodeBSON(lua_State *L, int idx, bson_t *bson) {
+	bson_t *doc;
+	int sidx = 0;
+	if (luaL_getmetafield(L, idx, "__toBSON")) {
+		if (testSchema(L, -1)) sidx = lua_gettop(L); /* Encode value according to schema */
+		else { /* Transform value */
+			lua_pushvalue(L, idx);
+			lua_call(L, 1, 1);
+			lua_replace(L, idx);
+		}
+	}
+	if (!sidx && (doc = testBSON(L, idx))) {
+		argCheck(L, doc != bson, idx, "invalid value");
+		bson_concat(bson, doc);
+		return true;
+	}
+	if (!sidx && !lua_istable(L, idx)) typeError(L, idx, "table or " TYPE_BSON);
+	if (!appendRoot(L, idx, sidx, bson)) return false;
+	if (sidx) lua_pop(L, 1);
+	return true;
+}
+
 bson_t *toBSON(lua_State *L, int idx) {
 	return luaL_opt(L, castBSON, idx, 0);
 }
@@ -718,7 +1250,6 @@ void toBSONValue(lua_State *L, int idx, bson_value_t *val) {
 		case LUA_TTABLE: {
 			lua_Integer len;
 			bson_t bson;
-			int nerr = 0;
 			if (luaL_getmetafield(L, idx, "__type")) {
 				toBSONType(L, lua_tointeger(L, -1), idx, val);
 				lua_pop(L, 1);
@@ -726,13 +1257,10 @@ void toBSONValue(lua_State *L, int idx, bson_value_t *val) {
 			}
 			len = getArrayLength(L, idx);
 			bson_init(&bson);
-			lua_newtable(L);
-			if (!appendTable(L, idx, lua_gettop(L), &nerr, &bson, len)) {
+			if (!appendRoot(L, idx, 0, &bson)) {
 				bson_destroy(&bson);
-				lua_concat(L, nerr);
 				luaL_argerror(L, idx, lua_tostring(L, -1));
 			}
-			lua_pop(L, 1);
 			val->value_type = len != -1 ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
 			val->value.v_doc.data = bson_destroy_with_steal(&bson, true, &val->value.v_doc.data_len);
 			break;
@@ -740,6 +1268,11 @@ void toBSONValue(lua_State *L, int idx, bson_value_t *val) {
 		case LUA_TUSERDATA: {
 			bson_t *bson;
 			bson_oid_t *oid;
+			bson_value_t *value;
+			if ((value = testBSONType(L, idx))) {
+				bson_value_copy(value, val);
+				break;
+			}
 			if ((bson = testBSON(L, idx))) {
 				val->value_type = isArray(bson) ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT;
 				memcpy(
@@ -0,0 +1,230 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define BUFFERSIZE 1048576 /* Default size of write buffer */
+
+typedef struct {
+	FILE *file;
+	bson_writer_t *writer; /* Writes documents straight into buffer */
+	uint8_t *buf;
+	size_t size; /* Buffer capacity */
+	size_t limit; /* Amount of buffered data that triggers writing */
+	bool busy; /* Document is being written */
+	int flags; /* Validation flags (VALIDATE_*) */
+	lua_Integer count, bytes;
+	int64_t vtime; /* Time spent on validation in microseconds */
+} Writer;
+
+static Writer *checkWriter(lua_State *L, int idx) {
+	Writer *w = luaL_checkudata(L, idx, TYPE_BSONFILEWRITER);
+	luaL_argcheck(L, w->file, idx, "writer is closed");
+	return w;
+}
+
+static int ioError(lua_State *L) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(errno));
+	return 2;
+}
+
+static bson_t *beginDocument(Writer *w) {
+	bson_t *bson;
+	if (w->busy) bson_writer_rollback(w->writer); /* Previous write was interrupted */
+	w->busy = bson_writer_begin(w->writer, &bson);
+	return w->busy ? bson : 0;
+}
+
+static bool flushWriter(Writer *w) {
+	size_t len;
+	bool ok;
+	if (w->busy) bson_writer_rollback(w->writer);
+	w->busy = false;
+	len = bson_writer_get_length(w->writer);
+	ok = !len || fwrite(w->buf, 1, len, w->file) == len;
+	bson_writer_destroy(w->writer); /* Buffer is retained */
+	w->writer = bson_writer_new(&w->buf, &w->size, 0, bson_realloc_ctx, 0);
+	return ok && !fflush(w->file);
+}
+
+static bool validateDocument(Writer *w, const bson_t *bson, bson_error_t *error) {
+	int64_t start;
+	bool ok;
+	if (!w->flags) return true;
+	start = bson_get_monotonic_time();
+	ok = validateBSON(bson, w->flags, error);
+	w->vtime += bson_get_monotonic_time() - start;
+	if (ok) return true;
+	bson_writer_rollback(w->writer);
+	w->busy = false;
+	return false;
+}
+
+static bool endDocument(Writer *w, const bson_t *bson) {
+	++w->count;
+	w->bytes += bson->len;
+	bson_writer_end(w->writer);
+	w->busy = false;
+	return bson_writer_get_length(w->writer) < w->limit || flushWriter(w);
+}
+
+static int m_close(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	bool ok = flushWriter(w);
+	ok = !fclose(w->file) && ok;
+	w->file = 0;
+	bson_writer_destroy(w->writer);
+	bson_free(w->buf);
+	w->writer = 0;
+	w->buf = 0;
+	if (!ok) return ioError(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int m_flush(lua_State *L) {
+	if (!flushWriter(checkWriter(L, 1))) return ioError(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int m_stats(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	lua_createtable(L, 0, 4);
+	pushInt64(L, w->count);
+	lua_setfield(L, -2, "count");
+	pushInt64(L, w->bytes);
+	lua_setfield(L, -2, "bytes");
+	pushInt64(L, (int64_t)bson_writer_get_length(w->writer));
+	lua_setfield(L, -2, "buffered");
+	lua_pushnumber(L, w->vtime / 1e6);
+	lua_setfield(L, -2, "validateSeconds");
+	return 1;
+}
+
+static int m_sync(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	if (!flushWriter(w)) return ioError(L);
+#ifdef _WIN32
+	if (_commit(_fileno(w->file))) return ioError(L);
+#else
+	if (fsync(fileno(w->file))) return ioError(L);
+#endif
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int m_write(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	bson_t *value = testBSON(L, 2), *bson;
+	bson_error_t error;
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	check(L, bson = beginDocument(w));
+	if (value) bson_concat(bson, value); /* Copy raw document */
+	else if (!encodeBSON(L, 2, bson)) {
+		bson_writer_rollback(w->writer);
+		w->busy = false;
+		return luaL_argerror(L, 2, lua_tostring(L, -1));
+	}
+	if (!validateDocument(w, bson, &error)) return luaL_argerror(L, 2, error.message);
+	if (!endDocument(w, bson)) return ioError(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int m_writeCursor(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	mongoc_cursor_t *cursor = advanceCursor(L, 2);
+	lua_Integer n = 0;
+	const bson_t *doc;
+	bson_error_t error;
+	while (mongoc_cursor_next(cursor, &doc)) {
+		bson_t *bson;
+		check(L, bson = beginDocument(w));
+		bson_concat(bson, doc);
+		checkStatus(L, validateDocument(w, bson, &error), &error);
+		++n;
+		if (!endDocument(w, bson)) return ioError(L);
+	}
+	checkStatus(L, !mongoc_cursor_error(cursor, &error), &error);
+	pushInt64(L, n);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Writer *w = luaL_checkudata(L, 1, TYPE_BSONFILEWRITER);
+	if (w->file) m_close(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"close", m_close},
+	{"flush", m_flush},
+	{"stats", m_stats},
+	{"sync", m_sync},
+	{"write", m_write},
+	{"writeCursor", m_writeCursor},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+int newBSONFileWriter(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer size = BUFFERSIZE;
+	bool append = false;
+	int flags = 0;
+	Writer *w;
+	FILE *f;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "bufferSize");
+		lua_getfield(L, 2, "append");
+		size = luaL_optinteger(L, -2, BUFFERSIZE);
+		append = lua_toboolean(L, -1);
+		flags = toValidateFlags(L, 2);
+		luaL_argcheck(L, size > 0 && size <= INT32_MAX, 2, "invalid value for 'bufferSize'");
+		lua_pop(L, 2);
+	}
+	if (!(f = fopen(path, append ? "ab" : "wb"))) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	setvbuf(f, 0, _IONBF, 0); /* Writes are buffered by writer */
+	w = lua_newuserdata(L, sizeof *w);
+	memset(w, 0, sizeof *w);
+	w->file = f;
+	w->size = w->limit = (size_t)size;
+	w->flags = flags;
+	w->buf = bson_malloc(w->size);
+	w->writer = bson_writer_new(&w->buf, &w->size, 0, bson_realloc_ctx, 0);
+	setType(L, TYPE_BSONFILEWRITER, funcs);
+	return 1;
+}
@@ -0,0 +1,276 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+	const uint8_t *data; /* File contents */
+	size_t start, pos, end; /* Range of documents and current offset */
+	int flags; /* Validation flags (VALIDATE_*), with structure checked if set */
+	void *buf; /* Data owned by reader (NULL if borrowed from parent reader) */
+	size_t size;
+	bool mapped; /* Owned data is memory-mapped */
+} Reader;
+
+static Reader *checkReader(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_BSONREADER);
+}
+
+static int nextDocument(Reader *r, bson_t *bson) {
+	uint32_t len;
+	if (r->pos >= r->end) return 0; /* No more documents */
+	if (r->end - r->pos < 5) return -1;
+	memcpy(&len, r->data + r->pos, sizeof len);
+	len = BSON_UINT32_FROM_LE(len);
+	if (len < 5 || len > r->end - r->pos || !bson_init_static(bson, r->data + r->pos, len)) return -1;
+	if (r->flags && (!bson_validate(bson, BSON_VALIDATE_NONE, 0) || !validateBSON(bson, r->flags, 0))) return -1;
+	r->pos += len;
+	return 1;
+}
+
+static void pushError(lua_State *L, const Reader *r) {
+	char buf[32];
+	snprintf(buf, sizeof buf, "%.0f", (double)r->pos);
+	lua_pushfstring(L, "invalid BSON document at offset %s", buf);
+}
+
+static int iterateReader(lua_State *L, Reader *r, int hidx, const UnpackOptions *opts) {
+	bson_t bson;
+	switch (nextDocument(r, &bson)) {
+		case 0:
+			lua_pushnil(L);
+			return 1;
+		case 1:
+			unpackBSON(L, &bson, hidx, opts);
+			return 1;
+		default:
+			pushError(L, r);
+			return lua_error(L);
+	}
+}
+
+static int iterator(lua_State *L) {
+	return iterateReader(L, checkReader(L, 1), lua_upvalueindex(1), lua_touserdata(L, lua_upvalueindex(2)));
+}
+
+static int m_iterator(lua_State *L) {
+	checkReader(L, 1);
+	lua_settop(L, 3);
+	toUnpackOptions(L, 3);
+	lua_pushcclosure(L, iterator, 2);
+	lua_pushvalue(L, 1); /* State */
+	return 2;
+}
+
+static int m_next(lua_State *L) {
+	Reader *r = checkReader(L, 1);
+	bson_t bson;
+	switch (nextDocument(r, &bson)) {
+		case 0:
+			lua_pushnil(L);
+			return 1;
+		case 1:
+			pushBSONViewData(L, bson_get_data(&bson), bson.len, false, 1); /* View into file data */
+			return 1;
+		default:
+			lua_pushnil(L);
+			pushError(L, r);
+			return 2;
+	}
+}
+
+static int m_range(lua_State *L) {
+	Reader *r = checkReader(L, 1);
+	pushInt64(L, (int64_t)r->start);
+	pushInt64(L, (int64_t)r->end);
+	return 2;
+}
+
+static int m_value(lua_State *L) {
+	Reader *r = checkReader(L, 1);
+	return iterateReader(L, r, 2, toUnpackOptions(L, 3));
+}
+
+static void newRange(lua_State *L, const Reader *r, size_t start, size_t end, int pidx);
+
+static int m_split(lua_State *L) {
+	Reader *r = checkReader(L, 1);
+	lua_Integer i, n = luaL_checkinteger(L, 2);
+	size_t start = r->pos, pos = r->pos, total = r->end - r->pos;
+	luaL_argcheck(L, n > 0 && n <= INT32_MAX, 2, "invalid number of parts");
+	lua_createtable(L, (int)n, 0);
+	for (i = 1; i <= n; ++i) {
+		size_t target = i == n ? r->end : r->pos + (size_t)((double)total * i / n);
+		while (pos < target && r->end - pos >= 4) { /* Walk whole documents up to the first boundary at or past target */
+			uint32_t len;
+			memcpy(&len, r->data + pos, sizeof len);
+			len = BSON_UINT32_FROM_LE(len);
+			if (len < 5 || len > r->end - pos) { /* Corrupt length: this part takes the rest, so reading it reports the error */
+				pos = r->end;
+				break;
+			}
+			pos += len;
+		}
+		if (i == n) pos = r->end;
+		newRange(L, r, start, pos, 1);
+		lua_rawseti(L, -2, (int)i);
+		start = pos;
+	}
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Reader *r = checkReader(L, 1);
+#ifndef _WIN32
+	if (r->mapped) {
+		munmap(r->buf, r->size);
+		r->buf = 0;
+	}
+#endif
+	bson_free(r->buf);
+	r->buf = 0;
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"iterator", m_iterator},
+	{"next", m_next},
+	{"range", m_range},
+	{"split", m_split},
+	{"value", m_value},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+static void newRange(lua_State *L, const Reader *r, size_t start, size_t end, int pidx) {
+	Reader *p = lua_newuserdata(L, sizeof *p);
+	memset(p, 0, sizeof *p);
+	p->data = r->data;
+	p->start = p->pos = start;
+	p->end = end;
+	p->flags = r->flags;
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, pidx);
+	lua_rawseti(L, -2, 1); /* Anchor parent reader that owns data */
+	lua_setuservalue(L, -2);
+	setType(L, TYPE_BSONREADER, funcs);
+}
+
+static bool readFile(const char *path, Reader *r) {
+#ifndef _WIN32
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return false;
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+	r->size = (size_t)st.st_size;
+	if (r->size && (r->buf = mmap(0, r->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		madvise(r->buf, r->size, MADV_SEQUENTIAL);
+#endif
+		r->mapped = true;
+		close(fd);
+		return true;
+	}
+	r->buf = 0;
+	if (r->size) { /* Fall back to reading */
+		size_t n = 0;
+		r->buf = bson_malloc(r->size);
+		while (n < r->size) {
+			ssize_t k = read(fd, (uint8_t *)r->buf + n, r->size - n);
+			if (k <= 0) {
+				int err = k ? errno : EIO;
+				close(fd);
+				errno = err;
+				return false;
+			}
+			n += (size_t)k;
+		}
+	}
+	close(fd);
+	return true;
+#else
+	FILE *f = fopen(path, "rb");
+	long size;
+	if (!f) return false;
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) goto error;
+	r->size = (size_t)size;
+	if (r->size) {
+		r->buf = bson_malloc(r->size);
+		if (fread(r->buf, 1, r->size, f) != r->size) goto error;
+	}
+	fclose(f);
+	return true;
+error:
+	fclose(f);
+	errno = EIO;
+	return false;
+#endif
+}
+
+int readBSONReader(lua_State *L, int idx, bson_t *bson) {
+	Reader *r = checkReader(L, idx);
+	int res = nextDocument(r, bson);
+	if (res < 0) pushError(L, r);
+	return res;
+}
+
+int newBSONReader(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer offset = 0, length = -1;
+	int flags = 0;
+	Reader *r;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "offset");
+		lua_getfield(L, 2, "length");
+		offset = luaL_optinteger(L, -2, 0);
+		length = luaL_optinteger(L, -1, -1);
+		luaL_argcheck(L, offset >= 0, 2, "invalid value for 'offset'");
+		lua_pop(L, 2);
+		flags = toValidateFlags(L, 2);
+	}
+	r = lua_newuserdata(L, sizeof *r); /* Owned data is freed on error */
+	memset(r, 0, sizeof *r);
+	setType(L, TYPE_BSONREADER, funcs);
+	if (!readFile(path, r)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	r->data = r->buf ? r->buf : (const uint8_t *)"";
+	r->start = r->pos = (size_t)offset < r->size ? (size_t)offset : r->size;
+	r->end = length < 0 || (size_t)length > r->size - r->start ? r->size : r->start + (size_t)length;
+	r->flags = flags;
+	return 1;
+}
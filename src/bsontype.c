@@ -22,28 +22,111 @@
 
 #include "common.h"
 
+static char VALUE; /* Marks metatables of BSON types stored as native values */
+
+static int pushParams(lua_State *L, int idx) {
+	const bson_value_t *val = testBSONType(L, idx);
+	if (!val) return lua_istable(L, idx) ? unpackParams(L, idx) : 0;
+	switch (val->value_type) {
+		case BSON_TYPE_INT32:
+			pushInt32(L, val->value.v_int32);
+			return 1;
+		case BSON_TYPE_INT64:
+			pushInt64(L, val->value.v_int64);
+			return 1;
+		case BSON_TYPE_DOUBLE:
+			lua_pushnumber(L, val->value.v_double);
+			return 1;
+		case BSON_TYPE_DECIMAL128: {
+			char buf[BSON_DECIMAL128_STRING];
+			bson_decimal128_to_string(&val->value.v_decimal128, buf);
+			lua_pushstring(L, buf);
+			return 1;
+		}
+		case BSON_TYPE_BINARY:
+			lua_pushlstring(L, (const char *)val->value.v_binary.data, val->value.v_binary.data_len);
+			lua_pushinteger(L, val->value.v_binary.subtype);
+			return 2;
+		case BSON_TYPE_DATE_TIME:
+			pushInt64(L, val->value.v_datetime);
+			return 1;
+		case BSON_TYPE_REGEX:
+			lua_pushstring(L, val->value.v_regex.regex);
+			lua_pushstring(L, val->value.v_regex.options);
+			return 2;
+		case BSON_TYPE_TIMESTAMP:
+			pushInt32(L, val->value.v_timestamp.timestamp);
+			pushInt32(L, val->value.v_timestamp.increment);
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+static bool equal(const bson_value_t *val1, const bson_value_t *val2) {
+	if (val1->value_type != val2->value_type) return false;
+	switch (val1->value_type) {
+		case BSON_TYPE_INT32:
+			return val1->value.v_int32 == val2->value.v_int32;
+		case BSON_TYPE_INT64:
+			return val1->value.v_int64 == val2->value.v_int64;
+		case BSON_TYPE_DOUBLE:
+			return val1->value.v_double == val2->value.v_double;
+		case BSON_TYPE_DECIMAL128:
+			return val1->value.v_decimal128.high == val2->value.v_decimal128.high
+				&& val1->value.v_decimal128.low == val2->value.v_decimal128.low;
+		case BSON_TYPE_BINARY:
+			return val1->value.v_binary.subtype == val2->value.v_binary.subtype
+				&& val1->value.v_binary.data_len == val2->value.v_binary.data_len
+				&& !memcmp(val1->value.v_binary.data, val2->value.v_binary.data, val1->value.v_binary.data_len);
+		case BSON_TYPE_DATE_TIME:
+			return val1->value.v_datetime == val2->value.v_datetime;
+		case BSON_TYPE_REGEX:
+			return !strcmp(val1->value.v_regex.regex, val2->value.v_regex.regex)
+				&& !strcmp(val1->value.v_regex.options, val2->value.v_regex.options);
+		case BSON_TYPE_TIMESTAMP:
+			return val1->value.v_timestamp.timestamp == val2->value.v_timestamp.timestamp
+				&& val1->value.v_timestamp.increment == val2->value.v_timestamp.increment;
+		default:
+			return false;
+	}
+}
+
 static int m_unpack(lua_State *L) {
-	return lua_istable(L, 1) ? unpackParams(L, 1) : 0;
+	return pushParams(L, 1);
 }
 
 static int m__tostring(lua_State *L) {
 	int i, n;
 	lua_settop(L, 1);
-	luaL_argcheck(L, lua_istable(L, 1) && luaL_getmetafield(L, 1, "__name"), 1, "invalid object");
-	n = lua_rawlen(L, 1);
-	if (!n) return 1; /* Type name with no arguments */
+	luaL_argcheck(L, (lua_istable(L, 1) || testBSONType(L, 1)) && luaL_getmetafield(L, 1, "__name"), 1, "invalid object");
+	n = pushParams(L, 1);
+	if (!n) { /* Type name with no arguments */
+		lua_settop(L, 2);
+		return 1;
+	}
 	luaL_checkstack(L, LUA_MINSTACK + n * 2, "too many parameters");
 	lua_pushliteral(L, "(");
 	for (i = 0; i < n; ++i) {
 		if (i) lua_pushliteral(L, ", ");
-		lua_rawgeti(L, 1, i + 1);
+		lua_pushvalue(L, i + 3);
 		if (luaL_callmeta(L, -1, "__tostring")) lua_replace(L, -2);
 		if (lua_type(L, -1) != LUA_TSTRING) continue;
 		lua_pushfstring(L, "\"%s\"", lua_tostring(L, -1));
 		lua_replace(L, -2);
 	}
 	lua_pushliteral(L, ")");
-	lua_concat(L, lua_gettop(L) - 1);
+	lua_concat(L, lua_gettop(L) - n - 2); /* Parameters */
+	lua_pushvalue(L, 2);
+	lua_insert(L, -2);
+	lua_concat(L, 2);
+	return 1;
+}
+
+static int m__eq(lua_State *L) {
+	const bson_value_t *val1 = testBSONType(L, 1);
+	const bson_value_t *val2 = testBSONType(L, 2);
+	lua_pushboolean(L, val1 && val2 && equal(val1, val2));
 	return 1;
 }
 
@@ -53,6 +136,13 @@ static const luaL_Reg funcs[] = {
 	{0, 0}
 };
 
+static const luaL_Reg valueFuncs[] = {
+	{"unpack", m_unpack},
+	{"__tostring", m__tostring},
+	{"__eq", m__eq},
+	{0, 0}
+};
+
 static void setBSONType(lua_State *L, const char *name, bson_type_t type) {
 	if (newType(L, name, funcs)) {
 		lua_pushinteger(L, type);
@@ -61,48 +151,75 @@ static void setBSONType(lua_State *L, const char *name, bson_type_t type) {
 	lua_setmetatable(L, -2);
 }
 
+static const char *getTypeName(bson_type_t type) {
+	switch (type) {
+		case BSON_TYPE_INT32:
+			return TYPE_INT32;
+		case BSON_TYPE_INT64:
+			return TYPE_INT64;
+		case BSON_TYPE_DOUBLE:
+			return TYPE_DOUBLE;
+		case BSON_TYPE_DECIMAL128:
+			return TYPE_DECIMAL128;
+		case BSON_TYPE_BINARY:
+			return TYPE_BINARY;
+		case BSON_TYPE_DATE_TIME:
+			return TYPE_DATETIME;
+		case BSON_TYPE_REGEX:
+			return TYPE_REGEX;
+		default:
+			return TYPE_TIMESTAMP;
+	}
+}
+
 int newBinary(lua_State *L) {
-	luaL_checkstring(L, 1);
-	luaL_optinteger(L, 2, 0);
-	packParams(L, 2);
-	setBSONType(L, TYPE_BINARY, BSON_TYPE_BINARY);
+	size_t len;
+	bson_value_t val;
+	val.value_type = BSON_TYPE_BINARY;
+	val.value.v_binary.data = (uint8_t *)luaL_checklstring(L, 1, &len);
+	val.value.v_binary.data_len = len;
+	val.value.v_binary.subtype = luaL_optinteger(L, 2, 0);
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newDateTime(lua_State *L) {
-	checkInt64(L, 1);
-	packParams(L, 1);
-	setBSONType(L, TYPE_DATETIME, BSON_TYPE_DATE_TIME);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_DATE_TIME;
+	val.value.v_datetime = checkInt64(L, 1);
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newDecimal128(lua_State *L) {
-	const char *str = luaL_checkstring(L, 1);
-	bson_decimal128_t dec;
-	luaL_argcheck(L, bson_decimal128_from_string(str, &dec), 1, "invalid format");
-	packParams(L, 1);
-	setBSONType(L, TYPE_DECIMAL128, BSON_TYPE_DECIMAL128);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_DECIMAL128;
+	luaL_argcheck(L, bson_decimal128_from_string(luaL_checkstring(L, 1), &val.value.v_decimal128), 1, "invalid format");
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newDouble(lua_State *L) {
-	luaL_checknumber(L, 1);
-	packParams(L, 1);
-	setBSONType(L, TYPE_DOUBLE, BSON_TYPE_DOUBLE);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_DOUBLE;
+	val.value.v_double = luaL_checknumber(L, 1);
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newInt32(lua_State *L) {
-	checkInt32(L, 1);
-	packParams(L, 1);
-	setBSONType(L, TYPE_INT32, BSON_TYPE_INT32);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_INT32;
+	val.value.v_int32 = checkInt32(L, 1);
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newInt64(lua_State *L) {
-	checkInt64(L, 1);
-	packParams(L, 1);
-	setBSONType(L, TYPE_INT64, BSON_TYPE_INT64);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_INT64;
+	val.value.v_int64 = checkInt64(L, 1);
+	pushBSONType(L, &val);
 	return 1;
 }
 
@@ -115,21 +232,65 @@ int newJavascript(lua_State *L) {
 }
 
 int newRegex(lua_State *L) {
-	luaL_checkstring(L, 1);
-	luaL_optstring(L, 2, 0);
-	packParams(L, 2);
-	setBSONType(L, TYPE_REGEX, BSON_TYPE_REGEX);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_REGEX;
+	val.value.v_regex.regex = (char *)luaL_checkstring(L, 1);
+	val.value.v_regex.options = (char *)luaL_optstring(L, 2, "");
+	pushBSONType(L, &val);
 	return 1;
 }
 
 int newTimestamp(lua_State *L) {
-	checkInt32(L, 1);
-	checkInt32(L, 2);
-	packParams(L, 2);
-	setBSONType(L, TYPE_TIMESTAMP, BSON_TYPE_TIMESTAMP);
+	bson_value_t val;
+	val.value_type = BSON_TYPE_TIMESTAMP;
+	val.value.v_timestamp.timestamp = checkInt32(L, 1);
+	val.value.v_timestamp.increment = checkInt32(L, 2);
+	pushBSONType(L, &val);
 	return 1;
 }
 
+void pushBSONType(lua_State *L, const bson_value_t *val) {
+	size_t len = 0, rlen = 0, olen = 0;
+	bson_value_t *obj;
+	switch (val->value_type) {
+		case BSON_TYPE_BINARY: /* Data is stored right after the value */
+			len = val->value.v_binary.data_len;
+			break;
+		case BSON_TYPE_REGEX: /* Regex and options are stored right after the value */
+			rlen = strlen(val->value.v_regex.regex) + 1;
+			olen = strlen(val->value.v_regex.options) + 1;
+			len = rlen + olen;
+			break;
+		default:
+			break;
+	}
+	obj = lua_newuserdata(L, sizeof *obj + len);
+	*obj = *val;
+	switch (val->value_type) {
+		case BSON_TYPE_BINARY:
+			obj->value.v_binary.data = memcpy(obj + 1, val->value.v_binary.data, len);
+			break;
+		case BSON_TYPE_REGEX:
+			obj->value.v_regex.regex = memcpy(obj + 1, val->value.v_regex.regex, rlen);
+			obj->value.v_regex.options = memcpy(obj->value.v_regex.regex + rlen, val->value.v_regex.options, olen);
+			break;
+		default:
+			break;
+	}
+	setValueType(L, getTypeName(val->value_type), val->value_type, valueFuncs);
+}
+
+void setValueType(lua_State *L, const char *name, bson_type_t type, const luaL_Reg *methods) {
+	if (newType(L, name, methods)) {
+		lua_pushinteger(L, type);
+		lua_setfield(L, -2, "__type");
+		lua_pushlightuserdata(L, &VALUE);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+	}
+	lua_setmetatable(L, -2);
+}
+
 void pushMaxKey(lua_State *L) {
 	lua_newtable(L);
 	setBSONType(L, TYPE_MAXKEY, BSON_TYPE_MAXKEY);
@@ -144,3 +305,13 @@ void pushNull(lua_State *L) {
 	lua_newtable(L);
 	setBSONType(L, TYPE_NULL, BSON_TYPE_NULL);
 }
+
+bson_value_t *testBSONType(lua_State *L, int idx) {
+	bson_value_t *val = lua_touserdata(L, idx);
+	if (!val || !lua_getmetatable(L, idx)) return 0;
+	lua_pushlightuserdata(L, &VALUE);
+	lua_rawget(L, -2);
+	if (!lua_toboolean(L, -1)) val = 0;
+	lua_pop(L, 2);
+	return val;
+}
@@ -0,0 +1,304 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+typedef struct {
+	const uint8_t *data; /* Document data owned by anchor (or stored right after the view) */
+	uint32_t len;
+	bool array;
+	uint32_t n; /* Number of elements (valid if 'offsets' is set) */
+	uint32_t *offsets; /* Element offsets for indexed access (built on demand) */
+	const uint32_t *source; /* Current generation of borrowed data (NULL if data never changes) */
+	uint32_t gen; /* Generation of borrowed data the view refers to */
+	uint32_t current; /* Current generation of data bound to this (root) view */
+} View;
+
+typedef struct {
+	bson_iter_t iter;
+	uint32_t gen; /* Generation of data being iterated */
+} Iterator;
+
+static char ANCHOR; /* Uservalue key for object owning view's data */
+
+static View *checkView(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_BSONVIEW);
+}
+
+static View *checkValidView(lua_State *L, int idx) {
+	View *view = checkView(L, idx);
+	luaL_argcheck(L, !view->source || *view->source == view->gen, idx, "view is no longer valid");
+	return view;
+}
+
+static bool buildIndex(View *view) {
+	bson_iter_t iter;
+	uint32_t n = 0, size = 16;
+	if (view->offsets) return true;
+	if (!bson_iter_init_from_data(&iter, view->data, view->len)) return false;
+	view->offsets = bson_malloc(size * sizeof *view->offsets);
+	while (bson_iter_next(&iter)) {
+		if (n == size) view->offsets = bson_realloc(view->offsets, (size *= 2) * sizeof *view->offsets);
+		view->offsets[n++] = bson_iter_offset(&iter);
+	}
+	view->n = n;
+	return true;
+}
+
+static View *newView(lua_State *L, const uint8_t *data, uint32_t len, bool array, int aidx);
+
+static bool pushElement(lua_State *L, int idx, bson_iter_t *iter) {
+	const View *parent = lua_touserdata(L, idx);
+	const uint8_t *data;
+	uint32_t len;
+	View *view;
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_DOCUMENT:
+			bson_iter_document(iter, &len, &data);
+			view = newView(L, data, len, false, idx);
+			break;
+		case BSON_TYPE_ARRAY:
+			bson_iter_array(iter, &len, &data);
+			view = newView(L, data, len, true, idx);
+			break;
+		default:
+			pushBSONValue(L, bson_iter_value(iter));
+			return false;
+	}
+	view->source = parent->source; /* Subview is valid as long as its parent is */
+	view->gen = parent->gen;
+	return true;
+}
+
+static bool findElement(lua_State *L, View *view, int kidx, bson_iter_t *iter) {
+	if (view->array) {
+		lua_Integer i;
+		uint32_t off;
+		if (lua_type(L, kidx) != LUA_TNUMBER || !buildIndex(view)) return false;
+		i = lua_tointeger(L, kidx);
+		if (i < 1 || i > view->n || i != lua_tonumber(L, kidx)) return false;
+		off = view->offsets[i - 1];
+		return bson_iter_init_from_data_at_offset(iter, view->data, view->len, off, strlen((const char *)view->data + off + 1));
+	} else {
+		size_t klen;
+		const char *key;
+		if (lua_type(L, kidx) != LUA_TSTRING) return false;
+		key = lua_tolstring(L, kidx, &klen);
+		return bson_iter_init_from_data(iter, view->data, view->len) && bson_iter_find_w_len(iter, key, klen);
+	}
+}
+
+static void copyView(lua_State *L, const View *view) {
+	uint8_t *data = lua_newuserdata(L, view->len);
+	memcpy(data, view->data, view->len);
+	newView(L, data, view->len, view->array, lua_gettop(L));
+	lua_replace(L, -2);
+}
+
+static int m_copy(lua_State *L) {
+	copyView(L, checkValidView(L, 1));
+	return 1;
+}
+
+static int m__pairs(lua_State *L);
+
+static const luaL_Reg methods[] = {
+	{"copy", m_copy},
+	{"pairs", m__pairs},
+	{0, 0}
+};
+
+static int pushMethod(lua_State *L, int kidx) {
+	const luaL_Reg *m;
+	const char *key;
+	if (lua_type(L, kidx) != LUA_TSTRING) return 0;
+	key = lua_tostring(L, kidx);
+	for (m = methods; m->name; ++m) {
+		if (strcmp(m->name, key)) continue;
+		lua_pushcfunction(L, m->func);
+		return 1;
+	}
+	return 0;
+}
+
+static int m__index(lua_State *L) {
+	View *view = checkValidView(L, 1);
+	bson_iter_t iter;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1); /* 3: subviews */
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 3);
+	if (!lua_isnil(L, -1)) return 1; /* Cached subview */
+	if (!findElement(L, view, 2, &iter)) return pushMethod(L, 2);
+	if (!pushElement(L, 1, &iter)) return 1; /* Scalar values are not cached */
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 3);
+	return 1;
+}
+
+static int iterator(lua_State *L) {
+	Iterator *it = lua_touserdata(L, lua_upvalueindex(1));
+	bson_iter_t *iter = &it->iter;
+	lua_Integer i = lua_tointeger(L, lua_upvalueindex(2));
+	View *view = checkValidView(L, 1);
+	luaL_argcheck(L, it->gen == view->gen, 1, "view is no longer valid");
+	if (!bson_iter_next(iter)) return 0;
+	lua_pushinteger(L, ++i);
+	lua_replace(L, lua_upvalueindex(2));
+	if (view->array) lua_pushinteger(L, i);
+	else lua_pushlstring(L, bson_iter_key(iter), bson_iter_key_len(iter));
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) { /* Decode value and cache subview */
+		lua_pop(L, 1);
+		if (pushElement(L, 1, iter)) {
+			lua_pushvalue(L, -3);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -4);
+		}
+	}
+	lua_replace(L, -2);
+	return 2;
+}
+
+static int m__pairs(lua_State *L) {
+	View *view = checkValidView(L, 1);
+	Iterator *it = lua_newuserdata(L, sizeof *it);
+	check(L, bson_iter_init_from_data(&it->iter, view->data, view->len));
+	it->gen = view->gen;
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, iterator, 2);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int m__len(lua_State *L) {
+	View *view = checkValidView(L, 1);
+	check(L, buildIndex(view));
+	lua_pushinteger(L, view->n);
+	return 1;
+}
+
+static int m__toBSON(lua_State *L) {
+	View *view = checkValidView(L, 1);
+	bson_t bson;
+	check(L, bson_init_static(&bson, view->data, view->len));
+	pushBSON(L, &bson, 0);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	bson_free(checkView(L, 1)->offsets);
+	unsetType(L);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"__index", m__index},
+	{"__pairs", m__pairs},
+	{"__len", m__len},
+	{"__toBSON", m__toBSON},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+static View *newView(lua_State *L, const uint8_t *data, uint32_t len, bool array, int aidx) {
+	View *view = lua_newuserdata(L, sizeof *view);
+	memset(view, 0, sizeof *view);
+	view->data = data;
+	view->len = len;
+	view->array = array;
+	lua_newtable(L); /* Subviews */
+	lua_pushlightuserdata(L, &ANCHOR);
+	lua_pushvalue(L, aidx);
+	lua_rawset(L, -3);
+	lua_setuservalue(L, -2);
+	setType(L, TYPE_BSONVIEW, funcs);
+	return view;
+}
+
+void pushBSONViewData(lua_State *L, const uint8_t *data, uint32_t len, bool array, int aidx) {
+	const View *parent;
+	View *view;
+	if (!aidx) { /* No anchor, copy data */
+		View tmp;
+		tmp.data = data;
+		tmp.len = len;
+		tmp.array = array;
+		copyView(L, &tmp);
+		return;
+	}
+	parent = luaL_testudata(L, aidx, TYPE_BSONVIEW);
+	view = newView(L, data, len, array, aidx);
+	if (!parent) return;
+	view->source = parent->source; /* Data is borrowed from parent */
+	view->gen = parent->gen;
+}
+
+void pushBSONView(lua_State *L, const bson_t *bson, int aidx) {
+	bson_iter_t iter;
+	View view;
+	view.data = bson_get_data(bson);
+	view.len = bson->len;
+	view.array = bson_iter_init(&iter, bson) && bson_iter_next(&iter) && !strcmp(bson_iter_key(&iter), "0");
+	if (aidx) newView(L, view.data, view.len, view.array, aidx); /* Data is owned by anchor */
+	else copyView(L, &view);
+}
+
+void pushBorrowedBSONView(lua_State *L, int aidx) {
+	View *view = newView(L, 0, 0, false, aidx);
+	view->source = &view->current;
+	view->current = 1; /* Not bound yet */
+}
+
+void bindBSONView(lua_State *L, int idx, const bson_t *bson) {
+	View *view = checkView(L, idx);
+	if (idx < 0) idx = lua_gettop(L) + idx + 1;
+	bson_free(view->offsets);
+	view->offsets = 0;
+	++view->current; /* Invalidate subviews and iterators */
+	if (bson) {
+		view->data = bson_get_data(bson);
+		view->len = bson->len;
+		view->gen = view->current;
+	}
+	lua_getuservalue(L, idx);
+	for (lua_pushnil(L); lua_next(L, -2);) { /* Clear subviews */
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TLIGHTUSERDATA) continue; /* Keep anchor */
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
+	}
+	lua_pop(L, 1);
+}
+
+const uint8_t *testBSONView(lua_State *L, int idx, uint32_t *len) {
+	View *view = luaL_testudata(L, idx, TYPE_BSONVIEW);
+	if (!view) return 0;
+	luaL_argcheck(L, !view->source || *view->source == view->gen, idx, "view is no longer valid");
+	*len = view->len;
+	return view->data;
+}
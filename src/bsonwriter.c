@@ -0,0 +1,189 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#define INLINESIZE 128 /* Approximate size of BSON inline storage */
+#define MAXDEPTH 32 /* Nesting limit for size estimation */
+
+typedef struct {
+	bson_t *bson; /* Reusable BSON document anchored in uservalue */
+	uint32_t size; /* Buffer size retained between conversions */
+	bool estimate, busy;
+	int flags; /* Validation flags (VALIDATE_*) */
+	lua_Integer count, bytes;
+	lua_Integer grows, saved; /* Estimated buffer doublings performed and avoided */
+	int64_t vtime; /* Time spent on validation in microseconds */
+} Writer;
+
+static Writer *checkWriter(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_BSONWRITER);
+}
+
+static void resetWriter(Writer *w) {
+	bson_destroy(w->bson);
+	bson_init(w->bson);
+	w->size = 0;
+	w->busy = false;
+}
+
+static int growths(uint32_t from, uint32_t to) {
+	int n = 0;
+	while (from < to) {
+		from <<= 1;
+		++n;
+	}
+	return n;
+}
+
+static size_t estimateSize(lua_State *L, int idx, int depth) {
+	size_t n = 5; /* Length prefix + trailing zero */
+	if (depth >= MAXDEPTH) return n;
+	luaL_checkstack(L, LUA_MINSTACK, "too many nested values");
+	for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
+		size_t len = 4; /* Array index */
+		bson_t *doc;
+		if (lua_type(L, -2) == LUA_TSTRING) lua_tolstring(L, -2, &len);
+		n += len + 2; /* Type + key + zero */
+		switch (lua_type(L, -1)) {
+			case LUA_TBOOLEAN:
+				n += 1;
+				break;
+			case LUA_TNUMBER:
+				n += 8;
+				break;
+			case LUA_TSTRING:
+				lua_tolstring(L, -1, &len);
+				n += len + 5;
+				break;
+			case LUA_TTABLE:
+				n += estimateSize(L, lua_gettop(L), depth + 1);
+				break;
+			case LUA_TUSERDATA:
+				if ((doc = testBSON(L, -1))) {
+					n += doc->len;
+					break;
+				}
+			/* Fall through */
+			default:
+				n += 16;
+				break;
+		}
+	}
+	return n;
+}
+
+static void reserve(Writer *w, size_t size) {
+	if (size <= w->size || size > INT32_MAX) return;
+	if (!bson_reserve_buffer(w->bson, size)) return;
+	w->grows += growths(w->size < INLINESIZE ? INLINESIZE : w->size, size);
+	w->size = size;
+}
+
+static int m_encode(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	bson_t *bson = w->bson;
+	int n;
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	if (w->busy) resetWriter(w); /* Previous conversion was interrupted */
+	if (w->estimate && lua_istable(L, 2)) reserve(w, estimateSize(L, 2, 0));
+	bson_reinit(bson);
+	w->busy = true;
+	if (!encodeBSON(L, 2, bson)) { /* Drop unfinished document */
+		resetWriter(w);
+		return luaL_argerror(L, 2, lua_tostring(L, -1));
+	}
+	w->busy = false;
+	if (w->flags) {
+		bson_error_t error;
+		int64_t start = bson_get_monotonic_time();
+		bool ok = validateBSON(bson, w->flags, &error);
+		w->vtime += bson_get_monotonic_time() - start;
+		if (!ok) return luaL_argerror(L, 2, error.message);
+	}
+	n = growths(w->size < INLINESIZE ? INLINESIZE : w->size, bson->len);
+	if (n) {
+		w->grows += n;
+		w->size = bson->len;
+	}
+	w->saved += growths(INLINESIZE, bson->len) - n;
+	w->bytes += bson->len;
+	++w->count;
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 1);
+	return 1;
+}
+
+static int m_stats(lua_State *L) {
+	Writer *w = checkWriter(L, 1);
+	lua_createtable(L, 0, 6);
+	pushInt64(L, w->count);
+	lua_setfield(L, -2, "count");
+	pushInt64(L, w->bytes);
+	lua_setfield(L, -2, "bytes");
+	pushInt64(L, w->size);
+	lua_setfield(L, -2, "size");
+	pushInt64(L, w->grows);
+	lua_setfield(L, -2, "estimatedGrows");
+	pushInt64(L, w->saved);
+	lua_setfield(L, -2, "estimatedSaved");
+	lua_pushnumber(L, w->vtime / 1e6);
+	lua_setfield(L, -2, "validateSeconds");
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{"encode", m_encode},
+	{"stats", m_stats},
+	{0, 0}
+};
+
+int newBSONWriter(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 1, 0);
+	bool estimate = lua_toboolean(L, 2);
+	int flags = 0;
+	Writer *w;
+	bson_t bson;
+	luaL_argcheck(L, size >= 0 && size <= INT32_MAX, 1, "invalid size");
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		flags = toValidateFlags(L, 3);
+	}
+	bson_init(&bson);
+	if (size > INLINESIZE) {
+		bson_reserve_buffer(&bson, size);
+		bson_reinit(&bson);
+	}
+	w = lua_newuserdata(L, sizeof *w);
+	memset(w, 0, sizeof *w);
+	w->size = size;
+	w->estimate = estimate;
+	w->flags = flags;
+	lua_createtable(L, 1, 0);
+	pushBSONWithSteal(L, &bson);
+	w->bson = lua_touserdata(L, -1);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, -2);
+	setType(L, TYPE_BSONWRITER, funcs);
+	return 1;
+}
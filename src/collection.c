@@ -95,7 +95,7 @@ static int m_findOne(lua_State *L) {
 	BSON_APPEND_INT32(&opts, "limit", 1);
 	BSON_APPEND_BOOL(&opts, "singleBatch", true);
 	cursor = mongoc_collection_find_with_opts(collection, query, &opts, prefs);
-	nres = iterateCursor(L, cursor, 0);
+	nres = iterateCursor(L, cursor, 0, 0);
 	mongoc_cursor_destroy(cursor);
 	bson_destroy(&opts);
 	return nres;
@@ -122,9 +122,8 @@ static int m_insert(lua_State *L) {
 static int m_insertMany(lua_State *L) {
 	mongoc_collection_t *collection = checkCollection(L, 1);
 	int i, n = lua_gettop(L) - 1;
-	const bson_t *documents[LUA_MINSTACK];
+	const bson_t **documents = lua_newuserdata(L, n * sizeof *documents);
 	bson_error_t error;
-	if (n > LUA_MINSTACK) return luaL_error(L, "too many documents");
 	for (i = 0; i < n; ++i) documents[i] = castBSON(L, i + 2);
 	return commandStatus(L, mongoc_collection_insert_many(collection, documents, n, 0, 0, &error), &error);
 }
@@ -227,11 +226,14 @@ static const luaL_Reg funcs[] = {
 	{"count", m_count},
 	{"createBulkOperation", m_createBulkOperation},
 	{"drop", m_drop},
+	{"exportTo", exportCollection},
 	{"find", m_find},
 	{"findAndModify", m_findAndModify},
 	{"findOne", m_findOne},
 	{"getName", m_getName},
 	{"getReadPrefs", m_getReadPrefs},
+	{"importBSON", importBSON},
+	{"importJSONLines", importJSONLines},
 	{"insert", m_insert},
 	{"insertMany", m_insertMany},
 	{"insertOne", m_insertOne},
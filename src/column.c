@@ -0,0 +1,317 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#define COLUMN_NONE 0 /* Not yet known (only nulls so far) */
+#define COLUMN_FLOAT64 1
+#define COLUMN_INT64 2
+#define COLUMN_STRING 3
+
+static const char *const names[] = {"float64", "int64", "string", 0};
+
+typedef struct {
+	int type;
+	bool fixed; /* Type was given explicitly */
+	size_t n, size; /* Number of values and capacity */
+	uint8_t *valid; /* Validity bitmap (LSB first) */
+	union {
+		double *f;
+		int64_t *i; /* Values or end offsets of strings */
+	} data;
+	char *str; /* String data */
+	size_t slen, ssize;
+} Column;
+
+static Column *checkColumn(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_COLUMN);
+}
+
+static const char *getTypeName(const Column *col) {
+	return names[(col->type ? col->type : COLUMN_FLOAT64) - 1];
+}
+
+static bool isValid(const Column *col, size_t i) {
+	return col->valid[i / 8] & (1 << i % 8);
+}
+
+static void pushElement(lua_State *L, const Column *col, size_t i) {
+	int64_t start;
+	if (!isValid(col, i)) {
+		lua_pushnil(L);
+		return;
+	}
+	switch (col->type) {
+		case COLUMN_FLOAT64:
+			lua_pushnumber(L, col->data.f[i]);
+			break;
+		case COLUMN_INT64:
+			pushInt64(L, col->data.i[i]);
+			break;
+		default:
+			start = i ? col->data.i[i - 1] : 0;
+			lua_pushlstring(L, col->str + start, (size_t)(col->data.i[i] - start));
+			break;
+	}
+}
+
+static int m_data(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	if (col->type == COLUMN_STRING) lua_pushlstring(L, col->str, col->slen);
+	else lua_pushlstring(L, (const char *)col->data.i, col->n * sizeof *col->data.i);
+	return 1;
+}
+
+static int m_type(lua_State *L) {
+	lua_pushstring(L, getTypeName(checkColumn(L, 1)));
+	return 1;
+}
+
+static int m_unpack(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	size_t i;
+	lua_pushstring(L, getTypeName(col));
+	lua_createtable(L, (int)col->n, 1);
+	for (i = 0; i < col->n; ++i) {
+		pushElement(L, col, i);
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	lua_pushinteger(L, (lua_Integer)col->n);
+	lua_setfield(L, -2, "__array");
+	return 2;
+}
+
+static int m_validity(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	lua_pushlstring(L, (const char *)col->valid, (col->n + 7) / 8);
+	return 1;
+}
+
+static int m__index(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	lua_Integer i;
+	if (lua_type(L, 2) != LUA_TNUMBER) { /* Method */
+		lua_getmetatable(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return 1;
+	}
+	i = lua_tointeger(L, 2);
+	if (i < 1 || (size_t)i > col->n) return 0;
+	pushElement(L, col, (size_t)i - 1);
+	return 1;
+}
+
+static int m__tostring(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	lua_pushfstring(L, TYPE_COLUMN "(\"%s\", %d)", getTypeName(col), (int)col->n);
+	return 1;
+}
+
+static int m__len(lua_State *L) {
+	lua_pushinteger(L, (lua_Integer)checkColumn(L, 1)->n);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Column *col = checkColumn(L, 1);
+	bson_free(col->valid);
+	bson_free(col->data.i);
+	bson_free(col->str);
+	memset(col, 0, sizeof *col);
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"data", m_data},
+	{"type", m_type},
+	{"unpack", m_unpack},
+	{"validity", m_validity},
+	{"__index", m__index},
+	{"__tostring", m__tostring},
+	{"__len", m__len},
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+static Column *newColumn(lua_State *L, int type) {
+	Column *col = lua_newuserdata(L, sizeof *col);
+	memset(col, 0, sizeof *col);
+	col->type = type;
+	col->fixed = type != COLUMN_NONE;
+	setType(L, TYPE_COLUMN, funcs);
+	return col;
+}
+
+static void reserve(Column *col, size_t len) {
+	if (col->n == col->size) {
+		size_t size = col->size ? col->size * 2 : 64; /* Multiple of 8 */
+		col->data.i = bson_realloc(col->data.i, size * sizeof *col->data.i);
+		col->valid = bson_realloc(col->valid, size / 8);
+		memset(col->valid + col->size / 8, 0, (size - col->size) / 8);
+		col->size = size;
+	}
+	if (col->slen + len > col->ssize) {
+		size_t size = col->ssize ? col->ssize : 256;
+		while (size < col->slen + len) size *= 2;
+		col->str = bson_realloc(col->str, size);
+		col->ssize = size;
+	}
+}
+
+static int inferType(bson_type_t type) {
+	switch (type) {
+		case BSON_TYPE_DOUBLE:
+			return COLUMN_FLOAT64;
+		case BSON_TYPE_BOOL:
+		case BSON_TYPE_DATE_TIME:
+		case BSON_TYPE_INT32:
+		case BSON_TYPE_INT64:
+			return COLUMN_INT64;
+		case BSON_TYPE_UTF8:
+			return COLUMN_STRING;
+		default:
+			return COLUMN_NONE;
+	}
+}
+
+static int64_t getInt64(const bson_iter_t *iter) {
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_BOOL:
+			return bson_iter_bool(iter);
+		case BSON_TYPE_DATE_TIME:
+			return bson_iter_date_time(iter);
+		case BSON_TYPE_INT32:
+			return bson_iter_int32(iter);
+		default:
+			return bson_iter_int64(iter);
+	}
+}
+
+static void promote(Column *col) {
+	size_t i;
+	for (i = 0; i < col->n; ++i) {
+		int64_t k = col->data.i[i];
+		col->data.f[i] = (double)k;
+	}
+	col->type = COLUMN_FLOAT64;
+}
+
+static void appendValue(Column *col, const bson_iter_t *iter) {
+	bson_type_t type = iter ? bson_iter_type(iter) : BSON_TYPE_NULL;
+	int vtype = inferType(type);
+	bool valid = false;
+	uint32_t len = 0;
+	const char *str = 0;
+	if (vtype == COLUMN_STRING) str = bson_iter_utf8(iter, &len);
+	if (!col->type) col->type = vtype;
+	else if (col->type == COLUMN_INT64 && vtype == COLUMN_FLOAT64 && !col->fixed) promote(col);
+	reserve(col, col->type == COLUMN_STRING ? len : 0);
+	switch (col->type) {
+		case COLUMN_FLOAT64:
+			if ((valid = vtype == COLUMN_FLOAT64)) col->data.f[col->n] = bson_iter_double(iter);
+			else if ((valid = vtype == COLUMN_INT64)) col->data.f[col->n] = (double)getInt64(iter);
+			else col->data.f[col->n] = 0;
+			break;
+		case COLUMN_INT64:
+			if ((valid = vtype == COLUMN_INT64)) col->data.i[col->n] = getInt64(iter);
+			else if (vtype == COLUMN_FLOAT64) { /* Accept integral values only */
+				double d = bson_iter_double(iter);
+				valid = d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double)(int64_t)d;
+				col->data.i[col->n] = valid ? (int64_t)d : 0;
+			} else col->data.i[col->n] = 0;
+			break;
+		case COLUMN_STRING:
+			if ((valid = vtype == COLUMN_STRING)) {
+				memcpy(col->str + col->slen, str, len);
+				col->slen += len;
+			}
+			col->data.i[col->n] = (int64_t)col->slen;
+			break;
+		default:
+			col->data.i[col->n] = 0;
+			break;
+	}
+	if (valid) col->valid[col->n / 8] |= 1 << col->n % 8;
+	++col->n;
+}
+
+int readColumns(lua_State *L, mongoc_cursor_t *cursor, int fidx, int oidx) {
+	const bson_t *bson;
+	bson_error_t error;
+	lua_Integer limit = -1, rows = 0;
+	size_t i, n;
+	Column **cols;
+	const char **paths;
+	int ridx;
+	luaL_checktype(L, fidx, LUA_TTABLE);
+	if (!lua_isnoneornil(L, oidx)) {
+		luaL_checktype(L, oidx, LUA_TTABLE);
+		lua_getfield(L, oidx, "limit");
+		if (!lua_isnil(L, -1)) luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER && (limit = lua_tointeger(L, -1)) >= 0, oidx, "invalid value for 'limit'");
+		lua_getfield(L, oidx, "types");
+		luaL_argcheck(L, lua_isnil(L, -1) || lua_istable(L, -1), oidx, "table expected for 'types'");
+		lua_replace(L, oidx); /* Keep field types only */
+		lua_pop(L, 1);
+	} else {
+		lua_settop(L, oidx - 1);
+		lua_pushnil(L);
+	}
+	n = lua_rawlen(L, fidx);
+	lua_createtable(L, 0, (int)n);
+	ridx = lua_gettop(L);
+	cols = lua_newuserdata(L, n * (sizeof *cols + sizeof *paths)); /* Scratch space */
+	paths = (const char **)(cols + n);
+	for (i = 0; i < n; ++i) {
+		int type = COLUMN_NONE;
+		lua_rawgeti(L, fidx, (int)i + 1);
+		if (lua_type(L, -1) != LUA_TSTRING) return argError(L, fidx, "[%d] => string expected, got %s", (int)i + 1, typeName(L, -1));
+		paths[i] = lua_tostring(L, -1); /* Anchored in table of fields */
+		lua_rawget(L, ridx);
+		if (!lua_isnil(L, -1)) return argError(L, fidx, "duplicate field '%s'", paths[i]);
+		lua_pop(L, 1);
+		if (!lua_isnil(L, oidx)) {
+			const char *name;
+			lua_getfield(L, oidx, paths[i]);
+			if (!lua_isnil(L, -1)) {
+				if (!(name = lua_tostring(L, -1))) return argError(L, oidx, "invalid type for field '%s'", paths[i]);
+				for (type = 0; names[type] && strcmp(names[type], name); ++type);
+				if (!names[type++]) return argError(L, oidx, "invalid type for field '%s'", paths[i]);
+			}
+			lua_pop(L, 1);
+		}
+		cols[i] = newColumn(L, type);
+		lua_setfield(L, ridx, paths[i]);
+	}
+	while (limit && mongoc_cursor_next(cursor, &bson)) {
+		for (i = 0; i < n; ++i) {
+			bson_iter_t iter, desc;
+			appendValue(cols[i], bson_iter_init(&iter, bson) && bson_iter_find_descendant(&iter, paths[i], &desc) ? &desc : 0);
+		}
+		if (limit > 0) --limit;
+		++rows;
+	}
+	checkStatus(L, !mongoc_cursor_error(cursor, &error), &error);
+	lua_pop(L, 1);
+	lua_pushinteger(L, rows);
+	return 2;
+}
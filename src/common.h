@@ -34,13 +34,19 @@
 
 #define TYPE_BINARY "mongo.Binary"
 #define TYPE_BSON "mongo.BSON"
+#define TYPE_BSONFILEWRITER "mongo.BSONFileWriter"
+#define TYPE_BSONREADER "mongo.BSONReader"
+#define TYPE_BSONVIEW "mongo.BSONView"
+#define TYPE_BSONWRITER "mongo.BSONWriter"
 #define TYPE_BULKOPERATION "mongo.BulkOperation"
 #define TYPE_CLIENT "mongo.Client"
 #define TYPE_COLLECTION "mongo.Collection"
+#define TYPE_COLUMN "mongo.Column"
 #define TYPE_CURSOR "mongo.Cursor"
 #define TYPE_DATABASE "mongo.Database"
 #define TYPE_DATETIME "mongo.DateTime"
 #define TYPE_DECIMAL128 "mongo.Decimal128"
+#define TYPE_DICTIONARY "mongo.Dictionary"
 #define TYPE_DOUBLE "mongo.Double"
 #define TYPE_GRIDFS "mongo.GridFS"
 #define TYPE_GRIDFSFILE "mongo.GridFSFile"
@@ -52,9 +58,13 @@
 #define TYPE_MINKEY "mongo.MinKey"
 #define TYPE_NULL "mongo.Null"
 #define TYPE_OBJECTID "mongo.ObjectID"
+#define TYPE_PATH "mongo.Path"
 #define TYPE_READPREFS "mongo.ReadPrefs"
 #define TYPE_REGEX "mongo.Regex"
+#define TYPE_SCHEMA "mongo.Schema"
 #define TYPE_TIMESTAMP "mongo.Timestamp"
+#define TYPE_UNPACKOPTIONS "mongo.UnpackOptions"
+#define TYPE_VECTOR "mongo.Vector"
 
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
@@ -68,11 +78,42 @@ EXPORT int luaopen_mongo(lua_State *L);
 #pragma GCC visibility push(hidden)
 #endif
 
-extern char NEW_BINARY, NEW_DATETIME, NEW_DECIMAL128, NEW_JAVASCRIPT, NEW_REGEX, NEW_TIMESTAMP;
+extern char NEW_JAVASCRIPT;
 extern char GLOBAL_MAXKEY, GLOBAL_MINKEY, GLOBAL_NULL;
 
+typedef struct Projection {
+	char *key; /* NULL matches any key */
+	size_t klen;
+	bool all; /* Select whole subtree */
+	int handler; /* Registry reference to handler, HANDLER_SKIP to skip subtree, or 0 */
+	struct Projection *child, *next;
+} Projection;
+
+#define HANDLER_SKIP (-1)
+
+typedef struct {
+	bool vectors; /* Unpack binary vectors as mongo.Vector */
+	int arrays; /* Unpack numeric arrays as mongo.Vector of this type */
+	Projection *fields; /* Selected fields (NULL if all) */
+	Projection *handlers; /* Handlers by path (NULL if none) */
+	bool rawDates; /* DateTime as milliseconds */
+	bool rawTimestamps; /* Timestamp as (t << 32 | i) */
+	bool rawBinaries; /* Binary as string */
+	bool rawDecimals; /* Decimal128 as string */
+	int objectIds; /* ObjectID as: 0 - object, OID_HEX - hex string, OID_BYTES - 12-byte string */
+	bool noArrayLength; /* Omit '__array' */
+	int into; /* Registry reference to target table (0 if none) */
+	int validate; /* Validation flags (VALIDATE_*) checked before unpacking */
+} UnpackOptions;
+
+#define OID_HEX 1
+#define OID_BYTES 2
+
 int newBinary(lua_State *L);
 int newBSON(lua_State *L);
+int newBSONFileWriter(lua_State *L);
+int newBSONReader(lua_State *L);
+int newBSONWriter(lua_State *L);
 int newClient(lua_State *L);
 int newDateTime(lua_State *L);
 int newDecimal128(lua_State *L);
@@ -81,14 +122,27 @@ int newInt32(lua_State *L);
 int newInt64(lua_State *L);
 int newJavascript(lua_State *L);
 int newObjectID(lua_State *L);
+int newPath(lua_State *L);
 int newReadPrefs(lua_State *L);
 int newRegex(lua_State *L);
+int newSchema(lua_State *L);
 int newTimestamp(lua_State *L);
+int newUnpackOptions(lua_State *L);
+int newVector(lua_State *L);
 
 void pushBSON(lua_State *L, const bson_t *bson, int hidx);
+void unpackBSON(lua_State *L, const bson_t *bson, int hidx, const UnpackOptions *opts);
 void pushBSONWithSteal(lua_State *L, bson_t *bson);
+void pushBSONView(lua_State *L, const bson_t *bson, int aidx);
+void pushBSONViewData(lua_State *L, const uint8_t *data, uint32_t len, bool array, int aidx);
+void pushBorrowedBSONView(lua_State *L, int aidx);
+void bindBSONView(lua_State *L, int idx, const bson_t *bson);
+void pushBSONWithSchema(lua_State *L, int idx, int sidx);
 void pushBSONValue(lua_State *L, const bson_value_t *val);
 void pushBSONField(lua_State *L, const bson_t *bson, const char *key, bool any);
+void pushBSONType(lua_State *L, const bson_value_t *val);
+bool pushVector(lua_State *L, const uint8_t *data, uint32_t len);
+bool pushVectorFromArray(lua_State *L, const bson_iter_t *iter, int type);
 void pushBulkOperation(lua_State *L, mongoc_bulk_operation_t *bulk, int pidx);
 void pushCollection(lua_State *L, mongoc_collection_t *collection, bool ref, int pidx);
 void pushCursor(lua_State *L, mongoc_cursor_t *cursor, int pidx);
@@ -102,15 +156,103 @@ void pushNull(lua_State *L);
 void pushObjectID(lua_State *L, const bson_oid_t *oid);
 void pushReadPrefs(lua_State *L, const mongoc_read_prefs_t *prefs);
 
-int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx);
+int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx, const UnpackOptions *opts);
+int readColumns(lua_State *L, mongoc_cursor_t *cursor, int fidx, int oidx);
+int readBSONReader(lua_State *L, int idx, bson_t *bson);
+
+#define MAXTHREADS 64 /* Maximum number of threads for parsing JSON */
+
+typedef struct {
+	const char *str; /* JSON input */
+	size_t len;
+	bson_t bson; /* Result (valid if 'ok' is set) */
+	bson_error_t error;
+	bool ok;
+} JSONItem;
+
+size_t parseJSONItems(JSONItem *items, size_t n, int threads);
+void destroyJSONItems(JSONItem *items, size_t n);
+int parseJSONBatch(lua_State *L);
+int importJSONLines(lua_State *L);
+int exportCollection(lua_State *L);
+int importBSON(lua_State *L);
+int compressBSON(lua_State *L);
+int compressCursor(lua_State *L);
+int decompress(lua_State *L);
+int trainDictionary(lua_State *L);
+int newDictionary(lua_State *L);
+int fromJSON(lua_State *L);
+int toJSON(lua_State *L);
+
+typedef struct {
+	luaL_Buffer b;
+	size_t len; /* Number of bytes written so far */
+	bool canonical;
+} JSONBuffer;
+
+bool toJSONMode(lua_State *L, int idx);
+void initJSONBuffer(lua_State *L, JSONBuffer *buf, bool canonical);
+void addJSONChar(JSONBuffer *buf, char c);
+void appendJSON(JSONBuffer *buf, const uint8_t *data, uint32_t len, bool array);
+
+typedef struct {
+	luaL_Buffer b;
+	size_t len; /* Number of bytes written so far */
+	bool cbor; /* CBOR instead of MessagePack */
+} Packer;
+
+void initPacker(lua_State *L, Packer *p, bool cbor);
+void appendPacked(Packer *p, const uint8_t *data, uint32_t len, bool array);
+int fromMsgPack(lua_State *L);
 
 bson_t *checkBSON(lua_State *L, int idx);
 bson_t *testBSON(lua_State *L, int idx);
 bson_t *castBSON(lua_State *L, int idx);
 bson_t *toBSON(lua_State *L, int idx);
+bool isBorrowedBSON(const bson_t *bson);
+
+const uint8_t *testBSONView(lua_State *L, int idx, uint32_t *len);
+
+bson_value_t *testBSONType(lua_State *L, int idx);
+void setValueType(lua_State *L, const char *name, bson_type_t type, const luaL_Reg *funcs);
+
+#define VECTOR_SUBTYPE 0x09 /* BSON binary subtype for packed vectors */
+#define VECTOR_FLOAT32 0x27
+#define VECTOR_INT8 0x03
+#define VECTOR_PACKED_BIT 0x10
+
+bson_value_t *checkVector(lua_State *L, int idx);
+int toVectorType(const char *name);
+
+UnpackOptions *toUnpackOptions(lua_State *L, int idx);
+const Projection *findProjection(const Projection *node, const char *key, size_t klen);
+
+bool encodeBSON(lua_State *L, int idx, bson_t *bson);
 
 void toBSONValue(lua_State *L, int idx, bson_value_t *val);
 
+#define VALIDATE_UTF8 0x01 /* Strings and keys are valid UTF-8 */
+#define VALIDATE_KEYS 0x02 /* Keys neither start with '$' nor contain '.' */
+
+bool isValidUTF8(const char *str, size_t len);
+bool validateBSON(const bson_t *bson, int flags, bson_error_t *error);
+int toValidateFlags(lua_State *L, int idx);
+
+typedef struct {
+	const char *key; /* Anchored in schema's uservalue */
+	size_t klen;
+	bson_type_t type; /* Expected BSON type or BSON_TYPE_EOD for any */
+	const char *tname;
+} SchemaField;
+
+typedef struct {
+	int n;
+	SchemaField fields[];
+} Schema;
+
+Schema *checkSchema(lua_State *L, int idx);
+Schema *testSchema(lua_State *L, int idx);
+
 bson_oid_t *checkObjectID(lua_State *L, int idx);
 bson_oid_t *testObjectID(lua_State *L, int idx);
 
@@ -118,6 +260,7 @@ mongoc_bulk_operation_t *checkBulkOperation(lua_State *L, int idx);
 mongoc_client_t *checkClient(lua_State *L, int idx);
 mongoc_collection_t *checkCollection(lua_State *L, int idx);
 mongoc_cursor_t *checkCursor(lua_State *L, int idx);
+mongoc_cursor_t *advanceCursor(lua_State *L, int idx);
 mongoc_database_t *checkDatabase(lua_State *L, int idx);
 mongoc_gridfs_t *checkGridFS(lua_State *L, int idx);
 mongoc_gridfs_file_t *checkGridFSFile(lua_State *L, int idx);
@@ -0,0 +1,287 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+
+#define DICTSIZE 112640 /* Default dictionary size (as in 'zstd --train') */
+#define MAXSIZE 16777216 /* Default decompressed size limit (maximum BSON document size) */
+
+typedef struct {
+	ZSTD_CDict *cdict; /* Compiled on first use for 'level' */
+	ZSTD_DDict *ddict; /* Compiled on first use */
+	int level;
+	size_t len;
+	char data[]; /* Raw dictionary */
+} Dictionary;
+
+typedef struct {
+	int level;
+	lua_Integer max;
+	Dictionary *dict;
+	const char *data; /* Raw dictionary passed as string */
+	size_t dlen;
+} Options;
+
+static int m_data(lua_State *L) {
+	Dictionary *dict = luaL_checkudata(L, 1, TYPE_DICTIONARY);
+	lua_pushlstring(L, dict->data, dict->len);
+	return 1;
+}
+
+static int m__gc(lua_State *L) {
+	Dictionary *dict = luaL_checkudata(L, 1, TYPE_DICTIONARY);
+	ZSTD_freeCDict(dict->cdict);
+	ZSTD_freeDDict(dict->ddict);
+	return 0;
+}
+
+static int m__len(lua_State *L) {
+	Dictionary *dict = luaL_checkudata(L, 1, TYPE_DICTIONARY);
+	lua_pushinteger(L, (lua_Integer)dict->len);
+	return 1;
+}
+
+static int m__tostring(lua_State *L) {
+	Dictionary *dict = luaL_checkudata(L, 1, TYPE_DICTIONARY);
+	lua_pushfstring(L, TYPE_DICTIONARY "(%d)", (int)dict->len);
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{"data", m_data},
+	{"__gc", m__gc},
+	{"__len", m__len},
+	{"__tostring", m__tostring},
+	{0, 0}
+};
+
+static void pushDictionary(lua_State *L, const char *data, size_t len) {
+	Dictionary *dict = lua_newuserdata(L, sizeof *dict + len);
+	memset(dict, 0, sizeof *dict);
+	memcpy(dict->data, data, len);
+	dict->len = len;
+	setType(L, TYPE_DICTIONARY, funcs);
+}
+
+static ZSTD_CDict *getCDict(lua_State *L, Dictionary *dict, int level) {
+	if (dict->cdict && dict->level == level) return dict->cdict;
+	ZSTD_freeCDict(dict->cdict);
+	check(L, dict->cdict = ZSTD_createCDict(dict->data, dict->len, level));
+	dict->level = level;
+	return dict->cdict;
+}
+
+static ZSTD_DDict *getDDict(lua_State *L, Dictionary *dict) {
+	if (!dict->ddict) check(L, dict->ddict = ZSTD_createDDict(dict->data, dict->len));
+	return dict->ddict;
+}
+
+static void getOptions(lua_State *L, int idx, Options *opts, bool compress) {
+	const char *codec;
+	opts->level = ZSTD_CLEVEL_DEFAULT;
+	opts->max = MAXSIZE;
+	opts->dict = 0;
+	opts->data = 0;
+	opts->dlen = 0;
+	if (lua_isnoneornil(L, idx)) return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "codec");
+	lua_getfield(L, idx, "level");
+	lua_getfield(L, idx, "dict");
+	lua_getfield(L, idx, "maxSize");
+	codec = luaL_optstring(L, -4, "zstd");
+	argCheck(L, !strcmp(codec, "zstd"), idx, "invalid codec '%s'", codec);
+	if (compress) {
+		lua_Integer level = luaL_optinteger(L, -3, ZSTD_CLEVEL_DEFAULT);
+		luaL_argcheck(L, level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel(), idx, "invalid value for 'level'");
+		opts->level = (int)level;
+	} else {
+		opts->max = luaL_optinteger(L, -1, MAXSIZE);
+		luaL_argcheck(L, opts->max >= 5 && opts->max <= INT32_MAX, idx, "invalid value for 'maxSize'");
+	}
+	if (!(opts->dict = luaL_testudata(L, -2, TYPE_DICTIONARY))) opts->data = luaL_optlstring(L, -2, 0, &opts->dlen); /* Anchored in options table */
+	lua_pop(L, 4);
+}
+
+static void pushCompressed(lua_State *L, const uint8_t *data, size_t len, const Options *opts) {
+	size_t size = ZSTD_compressBound(len), res;
+	char *buf = lua_newuserdata(L, size); /* Collected even if pushing the result fails */
+	ZSTD_CDict *cdict = opts->dict ? getCDict(L, opts->dict, opts->level) : 0;
+	ZSTD_CCtx *ctx;
+	check(L, ctx = ZSTD_createCCtx());
+	if (cdict) res = ZSTD_compress_usingCDict(ctx, buf, size, data, len, cdict);
+	else res = ZSTD_compress_usingDict(ctx, buf, size, data, len, opts->data, opts->dlen, opts->level);
+	ZSTD_freeCCtx(ctx);
+	if (ZSTD_isError(res)) luaL_error(L, "compression failed: %s", ZSTD_getErrorName(res));
+	lua_pushlstring(L, buf, res);
+	lua_remove(L, -2);
+}
+
+int compressBSON(lua_State *L) {
+	bson_t *bson = checkBSON(L, 1);
+	Options opts;
+	getOptions(L, 2, &opts, true);
+	pushCompressed(L, bson_get_data(bson), bson->len, &opts);
+	return 1;
+}
+
+int compressCursor(lua_State *L) {
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	lua_Integer max = 0, n = 0;
+	const bson_t *doc;
+	bson_error_t error;
+	bson_t bson;
+	Options opts;
+	getOptions(L, 2, &opts, true); /* Check options before draining cursor */
+	if (!lua_isnoneornil(L, 2)) {
+		lua_getfield(L, 2, "maxBytes");
+		max = luaL_optinteger(L, -1, 0);
+		luaL_argcheck(L, max >= 0, 2, "invalid maximum number of bytes");
+		lua_pop(L, 1);
+	}
+	bson_init(&bson);
+	while ((!max || bson.len < (size_t)max) && mongoc_cursor_next(cursor, &doc)) { /* Root array of documents */
+		char buf[16];
+		const char *key;
+		size_t klen = bson_uint32_to_string(n++, &key, buf, sizeof buf);
+		if (!bson_append_document(&bson, key, klen, doc)) {
+			bson_destroy(&bson);
+			return luaL_error(L, "result set is too large");
+		}
+	}
+	if (mongoc_cursor_error(cursor, &error)) {
+		bson_destroy(&bson);
+		checkStatus(L, false, &error);
+	}
+	lua_settop(L, 2); /* Options (possibly nil) */
+	lua_pushcfunction(L, compressBSON); /* Keep document in a userdata to survive errors */
+	pushBSONWithSteal(L, &bson);
+	lua_pushvalue(L, 2);
+	lua_call(L, 2, 1);
+	pushInt64(L, n);
+	return 2;
+}
+
+int decompress(lua_State *L) {
+	size_t len;
+	const char *str = luaL_checklstring(L, 1, &len);
+	unsigned long long size = ZSTD_getFrameContentSize(str, len);
+	ZSTD_DCtx *ctx;
+	bson_error_t error;
+	bson_t bson;
+	size_t res;
+	ZSTD_DDict *ddict;
+	Options opts;
+	getOptions(L, 2, &opts, false);
+	luaL_argcheck(L, size != ZSTD_CONTENTSIZE_ERROR && size != ZSTD_CONTENTSIZE_UNKNOWN, 1, "compressed BSON data expected");
+	luaL_argcheck(L, size >= 5, 1, "invalid BSON size");
+	argCheck(L, size <= (unsigned long long)opts.max, 1, "decompressed size exceeds %d bytes", (int)opts.max);
+	ddict = opts.dict ? getDDict(L, opts.dict) : 0;
+	check(L, ctx = ZSTD_createDCtx());
+	bson_init(&bson);
+	if (ddict) res = ZSTD_decompress_usingDDict(ctx, bson_reserve_buffer(&bson, (uint32_t)size), (size_t)size, str, len, ddict);
+	else res = ZSTD_decompress_usingDict(ctx, bson_reserve_buffer(&bson, (uint32_t)size), (size_t)size, str, len, opts.data, opts.dlen);
+	ZSTD_freeDCtx(ctx);
+	if (ZSTD_isError(res) || res != size) {
+		bson_destroy(&bson);
+		return argError(L, 1, "decompression failed: %s", ZSTD_isError(res) ? ZSTD_getErrorName(res) : "size mismatch");
+	}
+	if (!bson_validate_with_error(&bson, BSON_VALIDATE_NONE, &error)) {
+		bson_destroy(&bson);
+		return argError(L, 1, "%s", error.message);
+	}
+	pushBSONWithSteal(L, &bson);
+	return 1;
+}
+
+int trainDictionary(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 2, DICTSIZE), i, n;
+	size_t total = 0, *sizes, res;
+	char *data, *pos, *dict;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_argcheck(L, size > 0 && size <= INT32_MAX, 2, "invalid dictionary size");
+	n = lua_rawlen(L, 1);
+	luaL_argcheck(L, n > 0, 1, "no samples");
+	lua_settop(L, 2);
+	lua_createtable(L, (int)n, 0); /* Samples as BSON documents */
+	for (i = 1; i <= n; ++i) {
+		lua_rawgeti(L, 1, i);
+		total += castBSON(L, 4)->len;
+		lua_rawseti(L, 3, i);
+	}
+	sizes = lua_newuserdata(L, n * sizeof *sizes);
+	pos = data = lua_newuserdata(L, total);
+	for (i = 1; i <= n; ++i) {
+		bson_t *bson;
+		lua_rawgeti(L, 3, i);
+		bson = checkBSON(L, -1);
+		memcpy(pos, bson_get_data(bson), bson->len);
+		pos += bson->len;
+		sizes[i - 1] = bson->len;
+		lua_pop(L, 1);
+	}
+	dict = lua_newuserdata(L, (size_t)size);
+	res = ZDICT_trainFromBuffer(dict, (size_t)size, data, sizes, (unsigned)n);
+	if (ZDICT_isError(res)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "training failed: %s", ZDICT_getErrorName(res));
+		return 2;
+	}
+	pushDictionary(L, dict, res);
+	return 1;
+}
+
+int newDictionary(lua_State *L) {
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	luaL_argcheck(L, len > 0, 1, "empty dictionary");
+	pushDictionary(L, data, len);
+	return 1;
+}
+#else
+static int notSupported(lua_State *L) {
+	return luaL_error(L, "compression is not supported (built without zstd)");
+}
+
+int compressBSON(lua_State *L) {
+	return notSupported(L);
+}
+
+int compressCursor(lua_State *L) {
+	return notSupported(L);
+}
+
+int decompress(lua_State *L) {
+	return notSupported(L);
+}
+
+int newDictionary(lua_State *L) {
+	return notSupported(L);
+}
+
+int trainDictionary(lua_State *L) {
+	return notSupported(L);
+}
+#endif
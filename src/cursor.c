@@ -22,16 +22,59 @@
 
 #include "common.h"
 
+static char VIEW; /* Environment key for borrowed view */
+
+static void pushView(lua_State *L, int idx) {
+	lua_getuservalue(L, idx);
+	lua_pushlightuserdata(L, &VIEW);
+	lua_rawget(L, -2);
+	lua_replace(L, -2);
+}
+
+static int nextView(lua_State *L, mongoc_cursor_t *cursor) {
+	const bson_t *bson;
+	bson_error_t error;
+	if (!mongoc_cursor_next(cursor, &bson)) {
+		if (mongoc_cursor_error(cursor, &error)) return commandError(L, &error);
+		lua_pushnil(L);
+		return 1;
+	}
+	pushView(L, 1);
+	if (lua_isnil(L, -1)) { /* Create view on first use */
+		lua_pop(L, 1);
+		pushBorrowedBSONView(L, 1);
+		lua_getuservalue(L, 1);
+		lua_pushlightuserdata(L, &VIEW);
+		lua_pushvalue(L, -3);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	bindBSONView(L, -1, bson);
+	return 1;
+}
+
+static void flushJSON(lua_State *L, JSONBuffer *buf, int sidx) {
+	luaL_pushresult(&buf->b);
+	lua_pushvalue(L, sidx);
+	lua_insert(L, -2);
+	lua_call(L, 1, 0);
+}
+
 static int iterator(lua_State *L) {
-	return iterateCursor(L, checkCursor(L, 1), lua_upvalueindex(1));
+	return iterateCursor(L, advanceCursor(L, 1), lua_upvalueindex(1), lua_touserdata(L, lua_upvalueindex(2)));
+}
+
+static int m_columns(lua_State *L) {
+	return readColumns(L, advanceCursor(L, 1), 2, 3);
 }
 
 static int m_iterator(lua_State *L) {
 	checkCursor(L, 1);
-	if (lua_isnoneornil(L, 2)) lua_pushvalue(L, lua_upvalueindex(1)); /* Default iterator */
+	if (lua_isnoneornil(L, 2) && lua_isnoneornil(L, 3)) lua_pushvalue(L, lua_upvalueindex(1)); /* Default iterator */
 	else {
-		lua_pushvalue(L, 2);
-		lua_pushcclosure(L, iterator, 1); /* Iterator with handler */
+		lua_settop(L, 3);
+		toUnpackOptions(L, 3);
+		lua_pushcclosure(L, iterator, 2); /* Iterator with handler and options */
 	}
 	lua_pushvalue(L, 1); /* State */
 	return 2;
@@ -43,11 +86,103 @@ static int m_more(lua_State *L) {
 }
 
 static int m_next(lua_State *L) {
-	return iterateCursor(L, checkCursor(L, 1), 0);
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	if (lua_isnoneornil(L, 2)) return iterateCursor(L, cursor, 0, 0);
+	if (lua_type(L, 2) == LUA_TBOOLEAN) return lua_toboolean(L, 2) ? nextView(L, cursor) : iterateCursor(L, cursor, 0, 0);
+	lua_settop(L, 2);
+	lua_pushnil(L); /* No handler */
+	return iterateCursor(L, cursor, 3, toUnpackOptions(L, 2));
+}
+
+static int pack(lua_State *L, bool cbor) {
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	lua_Integer max = 0, n = 0;
+	const bson_t *bson;
+	bson_error_t error;
+	Packer p;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "maxBytes");
+		max = luaL_optinteger(L, -1, 0);
+		luaL_argcheck(L, max >= 0, 2, "invalid maximum number of bytes");
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 2);
+	initPacker(L, &p, cbor);
+	while ((!max || p.len < (size_t)max) && mongoc_cursor_next(cursor, &bson)) { /* Sequence of documents */
+		appendPacked(&p, bson_get_data(bson), bson->len, false);
+		++n;
+	}
+	checkStatus(L, !mongoc_cursor_error(cursor, &error), &error);
+	luaL_pushresult(&p.b);
+	pushInt64(L, n);
+	return 2;
+}
+
+static int m_toCBOR(lua_State *L) {
+	return pack(L, true);
+}
+
+static int m_toJSON(lua_State *L) {
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	bool canonical = toJSONMode(L, 2);
+	lua_Integer max = 0, n = 0;
+	const bson_t *bson;
+	bson_error_t error;
+	JSONBuffer buf;
+	if (!lua_isnoneornil(L, 2)) {
+		lua_getfield(L, 2, "maxBytes");
+		max = luaL_optinteger(L, -1, 0);
+		luaL_argcheck(L, max >= 0, 2, "invalid maximum number of bytes");
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 2);
+	initJSONBuffer(L, &buf, canonical);
+	addJSONChar(&buf, '[');
+	while ((!max || buf.len < (size_t)max) && mongoc_cursor_next(cursor, &bson)) { /* Stop at document boundary */
+		if (n++) addJSONChar(&buf, ',');
+		appendJSON(&buf, bson_get_data(bson), bson->len, false);
+	}
+	checkStatus(L, !mongoc_cursor_error(cursor, &error), &error);
+	addJSONChar(&buf, ']');
+	luaL_pushresult(&buf.b);
+	pushInt64(L, n);
+	return 2;
+}
+
+static int m_toMsgPack(lua_State *L) {
+	return pack(L, false);
 }
 
 static int m_value(lua_State *L) {
-	return iterateCursor(L, checkCursor(L, 1), 2);
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	return iterateCursor(L, cursor, 2, toUnpackOptions(L, 3));
+}
+
+static int m_writeJSON(lua_State *L) {
+	mongoc_cursor_t *cursor = advanceCursor(L, 1);
+	lua_Integer size = luaL_optinteger(L, 3, 65536), n = 0;
+	bool canonical = toJSONMode(L, 4);
+	const bson_t *bson;
+	bson_error_t error;
+	JSONBuffer buf;
+	luaL_checkany(L, 2);
+	luaL_argcheck(L, size > 0, 3, "invalid chunk size");
+	lua_settop(L, 4);
+	initJSONBuffer(L, &buf, canonical);
+	addJSONChar(&buf, '[');
+	while (mongoc_cursor_next(cursor, &bson)) {
+		if (n++) addJSONChar(&buf, ',');
+		appendJSON(&buf, bson_get_data(bson), bson->len, false);
+		if (buf.len < (size_t)size) continue;
+		flushJSON(L, &buf, 2);
+		initJSONBuffer(L, &buf, canonical);
+	}
+	checkStatus(L, !mongoc_cursor_error(cursor, &error), &error);
+	addJSONChar(&buf, ']');
+	flushJSON(L, &buf, 2);
+	pushInt64(L, n);
+	return 1;
 }
 
 static int m__gc(lua_State *L) {
@@ -57,15 +192,21 @@ static int m__gc(lua_State *L) {
 }
 
 static const luaL_Reg funcs[] = {
+	{"columns", m_columns},
+	{"compress", compressCursor},
 	{"more", m_more},
 	{"next", m_next},
+	{"toCBOR", m_toCBOR},
+	{"toJSON", m_toJSON},
+	{"toMsgPack", m_toMsgPack},
 	{"value", m_value},
+	{"writeJSON", m_writeJSON},
 	{"__gc", m__gc},
 	{0, 0}
 };
 
 void pushCursor(lua_State *L, mongoc_cursor_t *cursor, int pidx) {
-	pushHandle(L, cursor, -1, pidx);
+	pushHandle(L, cursor, 0, pidx); /* New environment for borrowed view */
 	if (newType(L, TYPE_CURSOR, funcs)) {
 		lua_pushcfunction(L, iterator); /* Default iterator ... */
 		lua_pushcclosure(L, m_iterator, 1); /* ... cached as upvalue 1 */
@@ -74,11 +215,12 @@ void pushCursor(lua_State *L, mongoc_cursor_t *cursor, int pidx) {
 	lua_setmetatable(L, -2);
 }
 
-int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx) {
+int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx, const UnpackOptions *opts) {
 	const bson_t *bson;
 	bson_error_t error;
 	if (mongoc_cursor_next(cursor, &bson)) {
-		pushBSON(L, bson, hidx);
+		if (hidx) unpackBSON(L, bson, hidx, opts);
+		else pushBSON(L, bson, 0);
 		return 1;
 	}
 	if (mongoc_cursor_error(cursor, &error)) {
@@ -92,3 +234,11 @@ int iterateCursor(lua_State *L, mongoc_cursor_t *cursor, int hidx) {
 mongoc_cursor_t *checkCursor(lua_State *L, int idx) {
 	return *(mongoc_cursor_t **)luaL_checkudata(L, idx, TYPE_CURSOR);
 }
+
+mongoc_cursor_t *advanceCursor(lua_State *L, int idx) {
+	mongoc_cursor_t *cursor = checkCursor(L, idx);
+	pushView(L, idx);
+	if (!lua_isnil(L, -1)) bindBSONView(L, -1, 0); /* Invalidate borrowed view */
+	lua_pop(L, 1);
+	return cursor;
+}
@@ -0,0 +1,144 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <errno.h>
+
+#define BUFFERSIZE 1048576 /* 1 MiB */
+#define TYPE_FILE "mongo.ExportFile" /* Internal holder of output file */
+
+static int m__gc(lua_State *L) {
+	FILE **f = lua_touserdata(L, 1);
+	if (*f) fclose(*f);
+	*f = 0;
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+static bool writeChunk(lua_State *L, JSONBuffer *buf, FILE *f, int64_t *bytes) {
+	size_t len, res;
+	const char *str;
+	luaL_pushresult(&buf->b);
+	str = lua_tolstring(L, -1, &len);
+	res = fwrite(str, 1, len, f);
+	lua_pop(L, 1);
+	*bytes += res;
+	initJSONBuffer(L, buf, buf->canonical);
+	return res == len;
+}
+
+int exportCollection(lua_State *L) {
+	mongoc_collection_t *collection = checkCollection(L, 1);
+	const char *path = luaL_checkstring(L, 2), *format;
+	bson_t *query = 0, *projection = 0, opts;
+	lua_Integer size = 0;
+	bool json = false, canonical = false, ok = true;
+	const char *error = 0;
+	mongoc_cursor_t *cursor;
+	const bson_t *bson;
+	bson_error_t err;
+	int64_t n = 0, bytes = 0, start = bson_get_monotonic_time();
+	double secs;
+	FILE **fp, *f;
+	lua_settop(L, 3);
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		canonical = toJSONMode(L, 3);
+		lua_getfield(L, 3, "format");
+		lua_getfield(L, 3, "batchSize");
+		if ((format = lua_tostring(L, 4))) {
+			json = !strcmp(format, "jsonl");
+			argCheck(L, json || !strcmp(format, "bson"), 3, "invalid format '%s'", format);
+		}
+		size = luaL_optinteger(L, 5, 0);
+		luaL_argcheck(L, size >= 0 && size <= INT32_MAX, 3, "invalid value for 'batchSize'");
+		lua_getfield(L, 3, "query");
+		lua_getfield(L, 3, "projection");
+		if (!lua_isnil(L, 6)) query = castBSON(L, 6); /* Anchored on stack */
+		if (!lua_isnil(L, 7)) projection = castBSON(L, 7);
+	}
+	fp = lua_newuserdata(L, sizeof *fp); /* File is closed by garbage collector on error */
+	*fp = 0;
+	setType(L, TYPE_FILE, funcs);
+	if (!(f = *fp = fopen(path, "wb"))) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	bson_init(&opts);
+	if (projection) BSON_APPEND_DOCUMENT(&opts, "projection", projection);
+	if (size) BSON_APPEND_INT32(&opts, "batchSize", (int32_t)size);
+	if (!query) { /* Match all documents */
+		lua_newtable(L);
+		query = castBSON(L, lua_gettop(L));
+	}
+	cursor = mongoc_collection_find_with_opts(collection, query, &opts, 0);
+	bson_destroy(&opts);
+	pushCursor(L, cursor, 1); /* Destroyed by garbage collector on error */
+	if (json) {
+		JSONBuffer buf;
+		initJSONBuffer(L, &buf, canonical);
+		while (ok && mongoc_cursor_next(cursor, &bson)) {
+			appendJSON(&buf, bson_get_data(bson), bson->len, false);
+			addJSONChar(&buf, '\n');
+			++n;
+			if (buf.len >= BUFFERSIZE) ok = writeChunk(L, &buf, f, &bytes);
+		}
+		if (ok) ok = writeChunk(L, &buf, f, &bytes);
+		luaL_pushresult(&buf.b);
+		lua_pop(L, 1);
+	} else {
+		setvbuf(f, 0, _IOFBF, BUFFERSIZE);
+		while (ok && mongoc_cursor_next(cursor, &bson)) {
+			size_t res = fwrite(bson_get_data(bson), 1, bson->len, f);
+			ok = res == bson->len;
+			bytes += res;
+			++n;
+		}
+	}
+	*fp = 0;
+	if (fclose(f)) ok = false;
+	if (!ok) error = strerror(errno);
+	else if (mongoc_cursor_error(cursor, &err)) error = err.message;
+	if (error) {
+		lua_pushnil(L);
+		if (ok) lua_pushstring(L, error);
+		else lua_pushfstring(L, "%s: %s", path, error);
+	}
+	secs = (bson_get_monotonic_time() - start) / 1e6;
+	lua_createtable(L, 0, 5);
+	pushInt64(L, n);
+	lua_setfield(L, -2, "documents");
+	pushInt64(L, bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, secs);
+	lua_setfield(L, -2, "seconds");
+	lua_pushnumber(L, secs > 0 ? n / secs : 0);
+	lua_setfield(L, -2, "documentsPerSecond");
+	lua_pushnumber(L, secs > 0 ? bytes / secs : 0);
+	lua_setfield(L, -2, "bytesPerSecond");
+	return error ? 3 : 1;
+}
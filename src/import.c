@@ -0,0 +1,488 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define BATCHSIZE 1000
+
+typedef struct {
+	FILE *file;
+	char *buf;
+	size_t size, len, pos; /* Buffer size, length of data, position of next line */
+	size_t lineno, bytes;
+	bool eof;
+} Reader;
+
+typedef struct {
+	const uint8_t *data; /* Consecutive BSON documents */
+	size_t len, n;
+} Chunk;
+
+typedef struct {
+	const bson_t *opts;
+	Chunk *chunks;
+	size_t n, next;
+	int64_t count;
+	bool ordered, failed; /* Ordered restore stops after the first failed batch */
+	bson_error_t *errors; /* Errors of failed batches */
+	size_t nerr, cap;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+#endif
+} Restore;
+
+typedef struct {
+	Restore *r;
+	mongoc_client_t *client; /* Own client of this worker (NULL for the calling thread) */
+	mongoc_collection_t *collection; /* Collection handle bound to worker's client */
+} Worker;
+
+typedef struct {
+	JSONItem *items;
+	size_t *lines; /* Line numbers */
+	char *data;
+	size_t *offs; /* Offsets of items in data */
+	size_t n, len, size;
+} Batch;
+
+#ifndef _WIN32
+typedef struct {
+	Batch *batch;
+	int threads;
+	size_t parsed;
+} Job;
+
+static void *parseBatch(void *arg) {
+	Job *job = arg;
+	job->parsed = parseJSONItems(job->batch->items, job->batch->n, job->threads);
+	return 0;
+}
+#endif
+
+static bool readLine(Reader *r, const char **line, size_t *len) {
+	for (;;) {
+		char *end = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+		if (end || (r->eof && r->pos < r->len)) {
+			if (!end) end = r->buf + r->len;
+			*line = r->buf + r->pos;
+			*len = end - *line;
+			r->pos = end - r->buf + (end < r->buf + r->len);
+			++r->lineno;
+			return true;
+		}
+		if (r->eof) return false;
+		if (r->pos) { /* Shift remainder to the beginning */
+			memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+			r->len -= r->pos;
+			r->pos = 0;
+		}
+		if (r->len == r->size) r->buf = bson_realloc(r->buf, r->size *= 2);
+		r->len += fread(r->buf + r->len, 1, r->size - r->len, r->file);
+		if (feof(r->file) || ferror(r->file)) r->eof = true;
+	}
+}
+
+static bool isBlank(const char *str, size_t len) {
+	while (len && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\r')) --len;
+	return !len;
+}
+
+static void fillBatch(Reader *r, Batch *b, size_t size) {
+	const char *line;
+	size_t i, len;
+	b->n = b->len = 0;
+	while (b->n < size && readLine(r, &line, &len)) {
+		r->bytes += len + 1;
+		if (isBlank(line, len)) continue;
+		if (b->len + len > b->size) {
+			b->size = b->size * 2 > b->len + len ? b->size * 2 : b->len + len;
+			b->data = bson_realloc(b->data, b->size);
+		}
+		memcpy(b->data + b->len, line, len);
+		b->offs[b->n] = b->len;
+		b->lines[b->n] = r->lineno;
+		b->items[b->n].len = len;
+		b->len += len;
+		++b->n;
+	}
+	for (i = 0; i < b->n; ++i) b->items[i].str = b->data + b->offs[i]; /* Data is not moved anymore */
+}
+
+static void initBatch(Batch *b, size_t size) {
+	memset(b, 0, sizeof *b);
+	b->items = bson_malloc(size * sizeof *b->items);
+	b->lines = bson_malloc(size * sizeof *b->lines);
+	b->offs = bson_malloc(size * sizeof *b->offs);
+}
+
+static void freeBatch(Batch *b) {
+	bson_free(b->items);
+	bson_free(b->lines);
+	bson_free(b->offs);
+	bson_free(b->data);
+}
+
+static bool executeBulk(mongoc_bulk_operation_t *bulk, bool ok, int64_t *count, bson_error_t *error) {
+	bson_iter_t iter;
+	bson_t reply;
+	if (ok) {
+		ok = mongoc_bulk_operation_execute(bulk, &reply, error);
+		if (bson_iter_init_find(&iter, &reply, "nInserted")) *count += bson_iter_as_int64(&iter);
+		bson_destroy(&reply);
+	}
+	mongoc_bulk_operation_destroy(bulk);
+	return ok;
+}
+
+static bool insertBatch(mongoc_collection_t *collection, const bson_t *opts, Batch *b, size_t n, int64_t *count, bson_error_t *error) {
+	mongoc_bulk_operation_t *bulk;
+	size_t i;
+	bool ok = true;
+	if (!n) return true;
+	bulk = mongoc_collection_create_bulk_operation_with_opts(collection, opts);
+	for (i = 0; ok && i < n; ++i) ok = mongoc_bulk_operation_insert_with_opts(bulk, &b->items[i].bson, 0, error);
+	return executeBulk(bulk, ok, count, error);
+}
+
+static void setStat(lua_State *L, const char *name, int64_t val) {
+	pushInt64(L, val);
+	lua_setfield(L, -2, name);
+}
+
+int importJSONLines(lua_State *L) {
+	mongoc_collection_t *collection = checkCollection(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_Integer size = BATCHSIZE, threads = 1;
+	bool ordered = true, failed = false;
+	bson_t *concern = 0, opts;
+	bson_error_t error;
+	Batch batches[2], *cur = batches, *next = batches + 1;
+	Reader r;
+	size_t parsed, nbatches = 0;
+	int64_t count = 0, start = bson_get_monotonic_time();
+	double secs;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "batchSize");
+		lua_getfield(L, 3, "parseThreads");
+		lua_getfield(L, 3, "ordered");
+		size = luaL_optinteger(L, -3, BATCHSIZE);
+		threads = luaL_optinteger(L, -2, 1);
+		if (!lua_isnil(L, -1)) ordered = lua_toboolean(L, -1);
+		luaL_argcheck(L, size > 0 && size <= INT32_MAX, 3, "invalid value for 'batchSize'");
+		luaL_argcheck(L, threads > 0, 3, "invalid value for 'parseThreads'");
+		if (threads > MAXTHREADS) threads = MAXTHREADS;
+		lua_pop(L, 3);
+		lua_getfield(L, 3, "writeConcern");
+		if (!lua_isnil(L, -1)) concern = castBSON(L, -1); /* Anchored on stack */
+	}
+	memset(&r, 0, sizeof r);
+	if (!(r.file = fopen(path, "rb"))) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	r.buf = bson_malloc(r.size = 65536);
+	bson_init(&opts);
+	BSON_APPEND_BOOL(&opts, "ordered", ordered);
+	if (concern) BSON_APPEND_DOCUMENT(&opts, "writeConcern", concern);
+	initBatch(cur, size);
+	initBatch(next, size);
+	fillBatch(&r, cur, size);
+	parsed = parseJSONItems(cur->items, cur->n, (int)threads);
+	while (cur->n) { /* Parse next batch while current one is being inserted */
+		size_t n = cur->n;
+		bool ok;
+		Batch *tmp;
+#ifndef _WIN32
+		pthread_t tid;
+		Job job;
+		bool async = false;
+#endif
+		if (parsed != n) { /* Insert documents preceding invalid line and stop */
+			snprintf(error.message, sizeof error.message, "%s:%lu: %s", path, (unsigned long)cur->lines[parsed], cur->items[parsed].error.message);
+			failed = true;
+			n = parsed;
+			next->n = 0;
+		} else fillBatch(&r, next, size);
+#ifndef _WIN32
+		if (next->n) {
+			job.batch = next;
+			job.threads = (int)threads;
+			async = !pthread_create(&tid, 0, parseBatch, &job);
+		}
+#endif
+		ok = insertBatch(collection, &opts, cur, n, &count, &error);
+		++nbatches;
+#ifndef _WIN32
+		if (async) {
+			pthread_join(tid, 0);
+			parsed = job.parsed;
+		} else
+#endif
+		parsed = parseJSONItems(next->items, next->n, (int)threads);
+		destroyJSONItems(cur->items, cur->n);
+		if (!ok || failed) {
+			destroyJSONItems(next->items, next->n);
+			failed = true;
+			break;
+		}
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+	if (!failed && ferror(r.file)) {
+		snprintf(error.message, sizeof error.message, "%s: read error", path);
+		failed = true;
+	}
+	fclose(r.file);
+	bson_free(r.buf);
+	freeBatch(cur);
+	freeBatch(next);
+	bson_destroy(&opts);
+	if (failed) {
+		lua_pushnil(L);
+		lua_pushstring(L, error.message);
+	}
+	lua_createtable(L, 0, 6);
+	secs = (bson_get_monotonic_time() - start) / 1e6;
+	setStat(L, "documents", count);
+	setStat(L, "lines", r.lineno);
+	setStat(L, "bytes", r.bytes);
+	setStat(L, "batches", nbatches);
+	lua_pushnumber(L, secs);
+	lua_setfield(L, -2, "seconds");
+	lua_pushnumber(L, secs > 0 ? count / secs : 0);
+	lua_setfield(L, -2, "documentsPerSecond");
+	return failed ? 3 : 1;
+}
+
+static bool insertChunk(const Worker *w, const Chunk *c, int64_t *count, bson_error_t *error) {
+	mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(w->collection, w->r->opts);
+	const uint8_t *pos = c->data;
+	size_t i;
+	bool ok = true;
+	for (i = 0; ok && i < c->n; ++i) { /* Boundaries have been checked by reader */
+		bson_t bson;
+		uint32_t len;
+		memcpy(&len, pos, sizeof len);
+		len = BSON_UINT32_FROM_LE(len);
+		bson_init_static(&bson, pos, len);
+		ok = mongoc_bulk_operation_insert_with_opts(bulk, &bson, 0, error);
+		pos += len;
+	}
+	return executeBulk(bulk, ok, count, error);
+}
+
+#ifdef _WIN32
+#define lockRestore(r) (void)0
+#define unlockRestore(r) (void)0
+#else
+#define lockRestore(r) pthread_mutex_lock(&(r)->mutex)
+#define unlockRestore(r) pthread_mutex_unlock(&(r)->mutex)
+#endif
+
+static void *work(void *arg) {
+	Worker *w = arg;
+	Restore *r = w->r;
+	for (;;) {
+		bson_error_t error;
+		int64_t count = 0;
+		size_t i;
+		bool ok;
+		lockRestore(r);
+		i = r->failed ? r->n : r->next;
+		if (i < r->n) ++r->next;
+		unlockRestore(r);
+		if (i == r->n) return 0;
+		ok = insertChunk(w, &r->chunks[i], &count, &error);
+		lockRestore(r);
+		r->count += count;
+		if (!ok) {
+			if (r->nerr == r->cap) r->errors = bson_realloc(r->errors, (r->cap = r->cap ? r->cap * 2 : 4) * sizeof *r->errors);
+			r->errors[r->nerr++] = error;
+			r->failed = r->ordered;
+		}
+		unlockRestore(r);
+	}
+}
+
+static mongoc_client_t *getClient(lua_State *L, int idx) {
+	mongoc_client_t **client;
+	lua_getuservalue(L, idx);
+	for (;;) { /* Find root environment */
+		lua_rawgeti(L, -1, 3);
+		if (lua_isnil(L, -1)) break;
+		lua_replace(L, -2);
+	}
+	lua_rawgeti(L, -2, 1);
+	client = luaL_testudata(L, -1, TYPE_CLIENT);
+	lua_pop(L, 3);
+	return client ? *client : 0;
+}
+
+static bool getDatabaseName(mongoc_collection_t *collection, char *buf, size_t size) {
+	bson_t cmd, reply;
+	bson_iter_t iter, ns;
+	const char *str, *dot;
+	bool ok;
+	bson_init(&cmd); /* The namespace is only known to the server's reply */
+	BSON_APPEND_UTF8(&cmd, "find", mongoc_collection_get_name(collection));
+	BSON_APPEND_INT32(&cmd, "limit", 1);
+	BSON_APPEND_BOOL(&cmd, "singleBatch", true);
+	ok = mongoc_collection_read_command_with_opts(collection, &cmd, 0, 0, &reply, 0)
+		&& bson_iter_init(&iter, &reply) && bson_iter_find_descendant(&iter, "cursor.ns", &ns) && BSON_ITER_HOLDS_UTF8(&ns)
+		&& (dot = strchr(str = bson_iter_utf8(&ns, 0), '.')) && (size_t)(dot - str) < size;
+	if (ok) {
+		memcpy(buf, str, dot - str);
+		buf[dot - str] = 0;
+	}
+	bson_destroy(&reply);
+	bson_destroy(&cmd);
+	return ok;
+}
+
+int importBSON(lua_State *L) {
+	mongoc_collection_t *collection = checkCollection(L, 1);
+	lua_Integer size, workers;
+	bool ordered = true;
+	bson_t *concern = 0, opts, bson;
+	const char *error = 0;
+	Restore r;
+	Worker ws[MAXTHREADS];
+	size_t cap = 16, bytes = 0;
+	int i, nw = 1, res;
+	int64_t start = bson_get_monotonic_time();
+	double secs;
+	if (lua_isnoneornil(L, 3)) { /* Options are always a table */
+		lua_settop(L, 2);
+		lua_newtable(L);
+	} else luaL_checktype(L, 3, LUA_TTABLE);
+	lua_settop(L, 3);
+	lua_getfield(L, 3, "batchSize");
+	lua_getfield(L, 3, "numInsertionWorkers");
+	lua_getfield(L, 3, "ordered");
+	lua_getfield(L, 3, "writeConcern");
+	size = luaL_optinteger(L, 4, BATCHSIZE);
+	workers = luaL_optinteger(L, 5, 1);
+	if (!lua_isnil(L, 6)) ordered = lua_toboolean(L, 6);
+	if (!lua_isnil(L, 7)) concern = castBSON(L, 7);
+	luaL_argcheck(L, size > 0 && size <= INT32_MAX, 3, "invalid value for 'batchSize'");
+	luaL_argcheck(L, workers > 0, 3, "invalid value for 'numInsertionWorkers'");
+	if (luaL_testudata(L, 2, TYPE_BSONREADER)) lua_pushvalue(L, 2);
+	else { /* Open file */
+		luaL_checkstring(L, 2);
+		lua_pushcfunction(L, newBSONReader);
+		lua_pushvalue(L, 2);
+		lua_createtable(L, 0, 1);
+		lua_getfield(L, 3, "validate");
+		lua_setfield(L, -2, "validate");
+		lua_call(L, 2, 2);
+		if (lua_isnil(L, -2)) return 2;
+		lua_pop(L, 1);
+	}
+	memset(&r, 0, sizeof r);
+	r.chunks = bson_malloc0(cap * sizeof *r.chunks);
+	while ((res = readBSONReader(L, 8, &bson)) == 1) { /* Split documents into batches */
+		Chunk *c = &r.chunks[r.n];
+		if (!c->n) c->data = bson_get_data(&bson);
+		c->len += bson.len;
+		bytes += bson.len;
+		if (++c->n < (size_t)size) continue;
+		if (++r.n == cap) r.chunks = bson_realloc(r.chunks, (cap *= 2) * sizeof *r.chunks);
+		memset(&r.chunks[r.n], 0, sizeof *r.chunks);
+	}
+	if (r.chunks[r.n].n) ++r.n;
+	if (res < 0) error = lua_tostring(L, -1); /* Invalid data (message is anchored on stack) */
+	bson_init(&opts);
+	BSON_APPEND_BOOL(&opts, "ordered", ordered);
+	if (concern) BSON_APPEND_DOCUMENT(&opts, "writeConcern", concern);
+	r.opts = &opts;
+	r.ordered = ordered;
+	ws[0].r = &r;
+	ws[0].client = 0;
+	ws[0].collection = collection; /* Calling thread uses collection's own client */
+#ifndef _WIN32
+	if (workers > MAXTHREADS) workers = MAXTHREADS;
+	if ((size_t)workers > r.n) workers = r.n ? r.n : 1;
+	pthread_mutex_init(&r.mutex, 0);
+	if (workers > 1) { /* Each extra worker has its own client and collection handle */
+		mongoc_client_t *client = getClient(L, 1);
+		pthread_t tids[MAXTHREADS - 1];
+		char db[128];
+		if (client && getDatabaseName(collection, db, sizeof db)) {
+			for (; nw < workers; ++nw) {
+				Worker *w = &ws[nw];
+				w->r = &r;
+				if (!(w->client = mongoc_client_new_from_uri(mongoc_client_get_uri(client)))) break;
+				w->collection = mongoc_client_get_collection(w->client, db, mongoc_collection_get_name(collection));
+				mongoc_collection_set_write_concern(w->collection, mongoc_collection_get_write_concern(collection));
+				if (pthread_create(&tids[nw - 1], 0, work, w)) {
+					mongoc_collection_destroy(w->collection);
+					mongoc_client_destroy(w->client);
+					break;
+				}
+			}
+		}
+		work(&ws[0]);
+		for (i = 1; i < nw; ++i) {
+			pthread_join(tids[i - 1], 0);
+			mongoc_collection_destroy(ws[i].collection);
+			mongoc_client_destroy(ws[i].client);
+		}
+	} else
+#endif
+	work(&ws[0]);
+#ifndef _WIN32
+	pthread_mutex_destroy(&r.mutex);
+#endif
+	bson_destroy(&opts);
+	bson_free(r.chunks);
+	if (!error && r.nerr) error = r.errors[0].message;
+	if (error) {
+		lua_pushnil(L);
+		if (r.nerr > 1) lua_pushfstring(L, "%s (and %d more failed batches)", error, (int)r.nerr - 1);
+		else lua_pushstring(L, error);
+	}
+	secs = (bson_get_monotonic_time() - start) / 1e6;
+	lua_createtable(L, 0, 7);
+	lua_createtable(L, (int)r.nerr, 0);
+	for (i = 0; (size_t)i < r.nerr; ++i) {
+		lua_pushstring(L, r.errors[i].message);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "errors");
+	bson_free(r.errors);
+	setStat(L, "documents", r.count);
+	setStat(L, "bytes", bytes);
+	setStat(L, "batches", r.n);
+	setStat(L, "workers", nw);
+	lua_pushnumber(L, secs);
+	lua_setfield(L, -2, "seconds");
+	lua_pushnumber(L, secs > 0 ? r.count / secs : 0);
+	lua_setfield(L, -2, "documentsPerSecond");
+	return error ? 3 : 1;
+}
@@ -0,0 +1,850 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <errno.h>
+#include <math.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define CHUNKSIZE 16 /* Number of items taken by a thread at a time */
+
+#ifndef _WIN32
+typedef struct {
+	JSONItem *items;
+	size_t n, next;
+	pthread_mutex_t mutex;
+} Pool;
+#endif
+
+static void parseItems(JSONItem *items, size_t n) {
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		JSONItem *item = &items[i];
+		item->ok = bson_init_from_json(&item->bson, item->str, item->len, &item->error);
+	}
+}
+
+#ifndef _WIN32
+static void *work(void *arg) {
+	Pool *pool = arg;
+	for (;;) {
+		size_t i, n;
+		pthread_mutex_lock(&pool->mutex);
+		i = pool->next;
+		n = pool->n - i < CHUNKSIZE ? pool->n - i : CHUNKSIZE;
+		pool->next += n;
+		pthread_mutex_unlock(&pool->mutex);
+		if (!n) return 0;
+		parseItems(pool->items + i, n);
+	}
+}
+#endif
+
+size_t parseJSONItems(JSONItem *items, size_t n, int threads) {
+	size_t i;
+#ifndef _WIN32
+	if (threads > 1 && n > CHUNKSIZE) { /* Calling thread takes part in parsing */
+		pthread_t tids[MAXTHREADS - 1];
+		Pool pool;
+		int t;
+		pool.items = items;
+		pool.n = n;
+		pool.next = 0;
+		pthread_mutex_init(&pool.mutex, 0);
+		if ((size_t)threads > (n + CHUNKSIZE - 1) / CHUNKSIZE) threads = (n + CHUNKSIZE - 1) / CHUNKSIZE;
+		for (t = 0; t < threads - 1; ++t) {
+			if (pthread_create(&tids[t], 0, work, &pool)) break;
+		}
+		work(&pool);
+		while (t--) pthread_join(tids[t], 0);
+		pthread_mutex_destroy(&pool.mutex);
+	} else
+#endif
+	parseItems(items, n);
+	for (i = 0; i < n && items[i].ok; ++i);
+	return i;
+}
+
+void destroyJSONItems(JSONItem *items, size_t n) {
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		if (items[i].ok) bson_destroy(&items[i].bson);
+	}
+}
+
+int parseJSONBatch(lua_State *L) {
+	lua_Integer threads = 1;
+	bool raw = false;
+	JSONItem *items;
+	size_t i, n;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "threads");
+		if (!lua_isnil(L, -1)) threads = lua_tointeger(L, -1);
+		lua_getfield(L, 2, "raw");
+		raw = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		luaL_argcheck(L, threads > 0, 2, "invalid number of threads");
+	}
+	n = lua_rawlen(L, 1);
+	lua_settop(L, 1);
+	items = lua_newuserdata(L, n * sizeof *items);
+	for (i = 0; i < n; ++i) {
+		lua_rawgeti(L, 1, i + 1);
+		if (lua_type(L, -1) != LUA_TSTRING) return argError(L, 1, "[%d] => string expected, got %s", (int)i + 1, typeName(L, -1));
+		items[i].str = lua_tolstring(L, -1, &items[i].len); /* Anchored in table */
+		lua_pop(L, 1);
+	}
+	if ((i = parseJSONItems(items, n, threads < MAXTHREADS ? threads : MAXTHREADS)) != n) { /* Parsing failed */
+		destroyJSONItems(items, n);
+		return argError(L, 1, "[%d] => %s", (int)i + 1, items[i].error.message);
+	}
+	if (raw) { /* Contiguous buffer */
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		for (i = 0; i < n; ++i) {
+			luaL_addlstring(&b, (const char *)bson_get_data(&items[i].bson), items[i].bson.len);
+			bson_destroy(&items[i].bson);
+		}
+		luaL_pushresult(&b);
+		return 1;
+	}
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; ++i) {
+		pushBSONWithSteal(L, &items[i].bson);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+
+/*
+** Extended JSON output
+*/
+
+#define ONES UINT64_C(0x0101010101010101)
+#define HIGHS UINT64_C(0x8080808080808080)
+#define isDigit(c) ((unsigned)((c) - '0') < 10)
+
+/* Checks 8 bytes at once for quotes, backslashes and control characters */
+static bool isPlainWord(const char *s) {
+	uint64_t w, q, e;
+	memcpy(&w, s, sizeof w);
+	q = w ^ (ONES * '"');
+	e = w ^ (ONES * '\\');
+	return !((((q - ONES) & ~q) | ((e - ONES) & ~e) | ((w - ONES * 0x20) & ~w)) & HIGHS);
+}
+
+static const char *skipPlain(const char *s, const char *end) {
+	while (end - s >= 8 && isPlainWord(s)) s += 8;
+	while (s < end && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) ++s;
+	return s;
+}
+
+static void addString(JSONBuffer *buf, const char *str, size_t len) {
+	luaL_addlstring(&buf->b, str, len);
+	buf->len += len;
+}
+
+void addJSONChar(JSONBuffer *buf, char c) {
+	luaL_addchar(&buf->b, c);
+	++buf->len;
+}
+
+#define addLiteral(buf, str) addString(buf, "" str, sizeof str - 1)
+
+static void addQuoted(JSONBuffer *buf, const char *str, size_t len) {
+	const char *end = str + len;
+	addJSONChar(buf, '"');
+	for (;;) {
+		const char *pos = skipPlain(str, end);
+		char esc[8];
+		addString(buf, str, pos - str);
+		if (pos == end) break;
+		switch (*pos) {
+			case '"':
+			case '\\':
+				esc[0] = '\\';
+				esc[1] = *pos;
+				addString(buf, esc, 2);
+				break;
+			case '\b':
+				addLiteral(buf, "\\b");
+				break;
+			case '\f':
+				addLiteral(buf, "\\f");
+				break;
+			case '\n':
+				addLiteral(buf, "\\n");
+				break;
+			case '\r':
+				addLiteral(buf, "\\r");
+				break;
+			case '\t':
+				addLiteral(buf, "\\t");
+				break;
+			default:
+				addString(buf, esc, sprintf(esc, "\\u%04x", (unsigned char)*pos));
+				break;
+		}
+		str = pos + 1;
+	}
+	addJSONChar(buf, '"');
+}
+
+static void addInteger(JSONBuffer *buf, int64_t val, const char *wrapper) {
+	char str[32];
+	int len = sprintf(str, "%lld", (long long)val);
+	if (!buf->canonical) {
+		addString(buf, str, len);
+		return;
+	}
+	addLiteral(buf, "{\"");
+	addString(buf, wrapper, strlen(wrapper));
+	addLiteral(buf, "\":\"");
+	addString(buf, str, len);
+	addLiteral(buf, "\"}");
+}
+
+static void addDouble(JSONBuffer *buf, double val) {
+	char str[32];
+	int len;
+	if (isnan(val)) len = sprintf(str, "NaN");
+	else if (isinf(val)) len = sprintf(str, val < 0 ? "-Infinity" : "Infinity");
+	else { /* Shortest representation that survives a round trip */
+		len = sprintf(str, "%.15g", val);
+		if (strtod(str, 0) != val) len = sprintf(str, "%.17g", val);
+		if (!strpbrk(str, ".e")) len += sprintf(str + len, ".0");
+		if (!buf->canonical) {
+			addString(buf, str, len);
+			return;
+		}
+	}
+	addLiteral(buf, "{\"$numberDouble\":\"");
+	addString(buf, str, len);
+	addLiteral(buf, "\"}");
+}
+
+static void addDate(JSONBuffer *buf, int64_t val) {
+	char str[32];
+	int len;
+	if (buf->canonical || val < 0 || val > INT64_C(253402300799999)) { /* Outside of years 1970-9999 */
+		addLiteral(buf, "{\"$date\":{\"$numberLong\":\"");
+		addString(buf, str, sprintf(str, "%lld", (long long)val));
+		addLiteral(buf, "\"}}");
+		return;
+	} else { /* Civil date from days since epoch */
+		int64_t ms = val % 86400000, z = val / 86400000 + 719468;
+		int64_t era = z / 146097, doe = z - era * 146097;
+		int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100), mp = (5 * doy + 2) / 153;
+		int d = (int)(doy - (153 * mp + 2) / 5 + 1), m = (int)(mp < 10 ? mp + 3 : mp - 9);
+		int y = (int)(yoe + era * 400 + (m <= 2));
+		len = sprintf(str, "%04d-%02d-%02dT%02d:%02d:%02d", y, m, d, (int)(ms / 3600000), (int)(ms / 60000 % 60), (int)(ms / 1000 % 60));
+		if (ms % 1000) len += sprintf(str + len, ".%03d", (int)(ms % 1000));
+	}
+	addLiteral(buf, "{\"$date\":\"");
+	addString(buf, str, len);
+	addLiteral(buf, "Z\"}");
+}
+
+static void addBase64(JSONBuffer *buf, const uint8_t *data, uint32_t len) {
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char str[64];
+	uint32_t i;
+	int n = 0;
+	for (i = 0; i < len; i += 3) {
+		uint32_t w = data[i] << 16;
+		if (i + 1 < len) w |= data[i + 1] << 8;
+		if (i + 2 < len) w |= data[i + 2];
+		str[n++] = digits[w >> 18];
+		str[n++] = digits[(w >> 12) & 0x3f];
+		str[n++] = i + 1 < len ? digits[(w >> 6) & 0x3f] : '=';
+		str[n++] = i + 2 < len ? digits[w & 0x3f] : '=';
+		if (n == sizeof str) {
+			addString(buf, str, n);
+			n = 0;
+		}
+	}
+	addString(buf, str, n);
+}
+
+static void addOID(JSONBuffer *buf, const bson_oid_t *oid) {
+	char str[25];
+	bson_oid_to_string(oid, str);
+	addLiteral(buf, "{\"$oid\":\"");
+	addString(buf, str, 24);
+	addLiteral(buf, "\"}");
+}
+
+static void addDocument(JSONBuffer *buf, bson_iter_t *iter, bool array);
+
+static void addSubdocument(JSONBuffer *buf, const bson_iter_t *iter, bool array) {
+	bson_iter_t child;
+	if (!bson_iter_recurse(iter, &child)) luaL_error(buf->b.L, "corrupt BSON document");
+	addDocument(buf, &child, array);
+}
+
+static void addValue(JSONBuffer *buf, bson_iter_t *iter) {
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_DOUBLE:
+			addDouble(buf, bson_iter_double(iter));
+			break;
+		case BSON_TYPE_UTF8: {
+			uint32_t len;
+			const char *str = bson_iter_utf8(iter, &len);
+			addQuoted(buf, str, len);
+			break;
+		}
+		case BSON_TYPE_DOCUMENT:
+			addSubdocument(buf, iter, false);
+			break;
+		case BSON_TYPE_ARRAY:
+			addSubdocument(buf, iter, true);
+			break;
+		case BSON_TYPE_BINARY: {
+			bson_subtype_t subtype;
+			uint32_t len;
+			const uint8_t *data;
+			char str[8];
+			bson_iter_binary(iter, &subtype, &len, &data);
+			addLiteral(buf, "{\"$binary\":{\"base64\":\"");
+			addBase64(buf, data, len);
+			addLiteral(buf, "\",\"subType\":\"");
+			addString(buf, str, sprintf(str, "%02x", (unsigned)subtype));
+			addLiteral(buf, "\"}}");
+			break;
+		}
+		case BSON_TYPE_UNDEFINED:
+			addLiteral(buf, "{\"$undefined\":true}");
+			break;
+		case BSON_TYPE_OID:
+			addOID(buf, bson_iter_oid(iter));
+			break;
+		case BSON_TYPE_BOOL:
+			if (bson_iter_bool(iter)) addLiteral(buf, "true");
+			else addLiteral(buf, "false");
+			break;
+		case BSON_TYPE_DATE_TIME:
+			addDate(buf, bson_iter_date_time(iter));
+			break;
+		case BSON_TYPE_NULL:
+			addLiteral(buf, "null");
+			break;
+		case BSON_TYPE_REGEX: {
+			const char *options, *regex = bson_iter_regex(iter, &options);
+			addLiteral(buf, "{\"$regularExpression\":{\"pattern\":");
+			addQuoted(buf, regex, strlen(regex));
+			addLiteral(buf, ",\"options\":");
+			addQuoted(buf, options, strlen(options));
+			addLiteral(buf, "}}");
+			break;
+		}
+		case BSON_TYPE_DBPOINTER: {
+			uint32_t len;
+			const char *str;
+			const bson_oid_t *oid;
+			bson_iter_dbpointer(iter, &len, &str, &oid);
+			addLiteral(buf, "{\"$dbPointer\":{\"$ref\":");
+			addQuoted(buf, str, len);
+			addLiteral(buf, ",\"$id\":");
+			addOID(buf, oid);
+			addLiteral(buf, "}}");
+			break;
+		}
+		case BSON_TYPE_CODE: {
+			uint32_t len;
+			const char *str = bson_iter_code(iter, &len);
+			addLiteral(buf, "{\"$code\":");
+			addQuoted(buf, str, len);
+			addJSONChar(buf, '}');
+			break;
+		}
+		case BSON_TYPE_SYMBOL: {
+			uint32_t len;
+			const char *str = bson_iter_symbol(iter, &len);
+			addLiteral(buf, "{\"$symbol\":");
+			addQuoted(buf, str, len);
+			addJSONChar(buf, '}');
+			break;
+		}
+		case BSON_TYPE_CODEWSCOPE: {
+			uint32_t len, slen;
+			const uint8_t *scope;
+			const char *str = bson_iter_codewscope(iter, &len, &slen, &scope);
+			addLiteral(buf, "{\"$code\":");
+			addQuoted(buf, str, len);
+			addLiteral(buf, ",\"$scope\":");
+			appendJSON(buf, scope, slen, false);
+			addJSONChar(buf, '}');
+			break;
+		}
+		case BSON_TYPE_INT32:
+			addInteger(buf, bson_iter_int32(iter), "$numberInt");
+			break;
+		case BSON_TYPE_TIMESTAMP: {
+			uint32_t t, i;
+			char str[48];
+			bson_iter_timestamp(iter, &t, &i);
+			addString(buf, str, sprintf(str, "{\"$timestamp\":{\"t\":%lu,\"i\":%lu}}", (unsigned long)t, (unsigned long)i));
+			break;
+		}
+		case BSON_TYPE_INT64:
+			addInteger(buf, bson_iter_int64(iter), "$numberLong");
+			break;
+		case BSON_TYPE_DECIMAL128: {
+			bson_decimal128_t dec;
+			char str[BSON_DECIMAL128_STRING];
+			bson_iter_decimal128(iter, &dec);
+			bson_decimal128_to_string(&dec, str);
+			addLiteral(buf, "{\"$numberDecimal\":\"");
+			addString(buf, str, strlen(str));
+			addLiteral(buf, "\"}");
+			break;
+		}
+		case BSON_TYPE_MAXKEY:
+			addLiteral(buf, "{\"$maxKey\":1}");
+			break;
+		case BSON_TYPE_MINKEY:
+			addLiteral(buf, "{\"$minKey\":1}");
+			break;
+		default:
+			luaL_error(buf->b.L, "corrupt BSON document");
+	}
+}
+
+static void addDocument(JSONBuffer *buf, bson_iter_t *iter, bool array) {
+	bool first = true;
+	addJSONChar(buf, array ? '[' : '{');
+	while (bson_iter_next(iter)) {
+		if (!first) addJSONChar(buf, ',');
+		first = false;
+		if (!array) {
+			addQuoted(buf, bson_iter_key(iter), bson_iter_key_len(iter));
+			addJSONChar(buf, ':');
+		}
+		addValue(buf, iter);
+	}
+	addJSONChar(buf, array ? ']' : '}');
+}
+
+bool toJSONMode(lua_State *L, int idx) {
+	const char *mode;
+	bool canonical = false;
+	if (lua_isnoneornil(L, idx)) return false;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "mode");
+	if ((mode = lua_tostring(L, -1))) {
+		if (!strcmp(mode, "canonical")) canonical = true;
+		else if (strcmp(mode, "relaxed")) argError(L, idx, "invalid mode '%s'", mode);
+	} else if (!lua_isnil(L, -1)) argError(L, idx, "invalid mode");
+	lua_pop(L, 1);
+	return canonical;
+}
+
+void initJSONBuffer(lua_State *L, JSONBuffer *buf, bool canonical) {
+	luaL_buffinit(L, &buf->b);
+	buf->len = 0;
+	buf->canonical = canonical;
+}
+
+void appendJSON(JSONBuffer *buf, const uint8_t *data, uint32_t len, bool array) {
+	bson_iter_t iter;
+	if (!bson_iter_init_from_data(&iter, data, len)) luaL_error(buf->b.L, "corrupt BSON document");
+	addDocument(buf, &iter, array);
+}
+
+int toJSON(lua_State *L) {
+	bool canonical = toJSONMode(L, 2);
+	const uint8_t *data;
+	uint32_t len;
+	bson_t *bson = 0;
+	JSONBuffer buf;
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	if ((data = testBSONView(L, 1, &len)) || (bson = testBSON(L, 1))) { /* Document as is */
+		if (!data) {
+			data = bson_get_data(bson);
+			len = bson->len;
+		}
+		initJSONBuffer(L, &buf, canonical);
+		appendJSON(&buf, data, len, false);
+	} else { /* Any other value is wrapped into a single-element document */
+		bson_value_t val;
+		bson_iter_t iter;
+		bson_t doc;
+		toBSONValue(L, 1, &val);
+		bson_init(&doc);
+		bson_append_value(&doc, "", 0, &val);
+		bson_value_destroy(&val);
+		pushBSONWithSteal(L, &doc); /* Anchor document in case of error */
+		check(L, bson_iter_init(&iter, bson = checkBSON(L, 2)) && bson_iter_next(&iter));
+		initJSONBuffer(L, &buf, canonical);
+		addValue(&buf, &iter);
+	}
+	luaL_pushresult(&buf.b);
+	return 1;
+}
+
+/*
+** Extended JSON input
+*/
+
+#define MAXDEPTH 200
+
+typedef struct {
+	lua_State *L;
+	const char *str, *pos, *end;
+	int depth;
+} Parser;
+
+static int parseError(Parser *p, const char *msg) {
+	return luaL_error(p->L, "invalid JSON at offset %d: %s", (int)(p->pos - p->str), msg);
+}
+
+static void skipSpace(Parser *p) {
+	while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r')) ++p->pos;
+}
+
+static bool skipChar(Parser *p, char c) {
+	skipSpace(p);
+	if (p->pos == p->end || *p->pos != c) return false;
+	++p->pos;
+	return true;
+}
+
+static unsigned parseHex(Parser *p) {
+	unsigned c = 0;
+	int i;
+	if (p->end - p->pos < 4) parseError(p, "invalid escape sequence");
+	for (i = 0; i < 4; ++i, ++p->pos) {
+		char x = *p->pos;
+		c <<= 4;
+		if (isDigit(x)) c |= x - '0';
+		else if (x >= 'a' && x <= 'f') c |= x - 'a' + 10;
+		else if (x >= 'A' && x <= 'F') c |= x - 'A' + 10;
+		else parseError(p, "invalid escape sequence");
+	}
+	return c;
+}
+
+static void addUTF8(luaL_Buffer *b, unsigned c) {
+	char str[4];
+	int n;
+	if (c < 0x80) {
+		str[0] = c;
+		n = 1;
+	} else if (c < 0x800) {
+		str[0] = 0xc0 | (c >> 6);
+		str[1] = 0x80 | (c & 0x3f);
+		n = 2;
+	} else if (c < 0x10000) {
+		str[0] = 0xe0 | (c >> 12);
+		str[1] = 0x80 | ((c >> 6) & 0x3f);
+		str[2] = 0x80 | (c & 0x3f);
+		n = 3;
+	} else {
+		str[0] = 0xf0 | (c >> 18);
+		str[1] = 0x80 | ((c >> 12) & 0x3f);
+		str[2] = 0x80 | ((c >> 6) & 0x3f);
+		str[3] = 0x80 | (c & 0x3f);
+		n = 4;
+	}
+	luaL_addlstring(b, str, n);
+}
+
+static void parseEscape(Parser *p, luaL_Buffer *b) {
+	unsigned c;
+	switch (*p->pos++) {
+		case '"':
+			luaL_addchar(b, '"');
+			return;
+		case '\\':
+			luaL_addchar(b, '\\');
+			return;
+		case '/':
+			luaL_addchar(b, '/');
+			return;
+		case 'b':
+			luaL_addchar(b, '\b');
+			return;
+		case 'f':
+			luaL_addchar(b, '\f');
+			return;
+		case 'n':
+			luaL_addchar(b, '\n');
+			return;
+		case 'r':
+			luaL_addchar(b, '\r');
+			return;
+		case 't':
+			luaL_addchar(b, '\t');
+			return;
+		case 'u':
+			break;
+		default:
+			--p->pos;
+			parseError(p, "invalid escape sequence");
+	}
+	c = parseHex(p);
+	if (c >= 0xd800 && c < 0xdc00) { /* Surrogate pair */
+		unsigned lo;
+		if (p->end - p->pos < 2 || p->pos[0] != '\\' || p->pos[1] != 'u') parseError(p, "invalid surrogate pair");
+		p->pos += 2;
+		if ((lo = parseHex(p)) < 0xdc00 || lo >= 0xe000) parseError(p, "invalid surrogate pair");
+		c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+	} else if (c >= 0xdc00 && c < 0xe000) parseError(p, "invalid surrogate pair");
+	addUTF8(b, c);
+}
+
+static void parseString(Parser *p) {
+	const char *pos = skipPlain(p->pos, p->end);
+	luaL_Buffer b;
+	if (pos < p->end && *pos == '"') { /* Fast path: no escape sequences */
+		lua_pushlstring(p->L, p->pos, pos - p->pos);
+		p->pos = pos + 1;
+		return;
+	}
+	luaL_buffinit(p->L, &b);
+	for (;;) {
+		luaL_addlstring(&b, p->pos, pos - p->pos);
+		p->pos = pos;
+		if (pos == p->end) parseError(p, "unterminated string");
+		if (*pos == '"') break;
+		if (*pos != '\\') parseError(p, "invalid character in string");
+		if (++p->pos == p->end) parseError(p, "unterminated string");
+		parseEscape(p, &b);
+		pos = skipPlain(p->pos, p->end);
+	}
+	++p->pos;
+	luaL_pushresult(&b);
+}
+
+static void parseNumber(Parser *p) {
+	const char *str = p->pos, *pos = str;
+	bool integer = true;
+	if (pos < p->end && *pos == '-') ++pos;
+	if (pos == p->end || !isDigit(*pos)) parseError(p, "unexpected character");
+	if (*pos == '0') ++pos;
+	else while (pos < p->end && isDigit(*pos)) ++pos;
+	if (pos < p->end && *pos == '.') {
+		integer = false;
+		if (++pos == p->end || !isDigit(*pos)) goto error;
+		while (pos < p->end && isDigit(*pos)) ++pos;
+	}
+	if (pos < p->end && (*pos == 'e' || *pos == 'E')) {
+		integer = false;
+		if (++pos < p->end && (*pos == '+' || *pos == '-')) ++pos;
+		if (pos == p->end || !isDigit(*pos)) goto error;
+		while (pos < p->end && isDigit(*pos)) ++pos;
+	}
+	p->pos = pos;
+	if (integer && pos - str <= 18) { /* Fits into 64 bits for sure */
+		int64_t n = 0;
+		for (pos = str + (*str == '-'); pos < p->pos; ++pos) n = n * 10 + (*pos - '0');
+		pushInt64(p->L, *str == '-' ? -n : n);
+		return;
+	}
+	if (integer) {
+		long long n;
+		errno = 0;
+		n = strtoll(str, 0, 10);
+		if (!errno) {
+			pushInt64(p->L, n);
+			return;
+		}
+	}
+	lua_pushnumber(p->L, strtod(str, 0)); /* Input is terminated by a non-numeric character */
+	return;
+error:
+	p->pos = pos;
+	parseError(p, "invalid number");
+}
+
+static void parseLiteral(Parser *p, const char *str, size_t len) {
+	if ((size_t)(p->end - p->pos) < len || memcmp(p->pos, str, len)) parseError(p, "unexpected character");
+	p->pos += len;
+}
+
+static void enterNested(Parser *p) {
+	if (++p->depth > MAXDEPTH) parseError(p, "too many nested values");
+	luaL_checkstack(p->L, 4, "too many nested values");
+	++p->pos;
+}
+
+/* Converts a single-field wrapper without reparsing */
+static bool convertSimple(lua_State *L) {
+	const char *key, *str;
+	char *end;
+	size_t len;
+	lua_pushnil(L);
+	if (!lua_next(L, -2)) return false;
+	if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) goto skip;
+	lua_pushvalue(L, -2);
+	if (lua_next(L, -4)) { /* More than one field */
+		lua_pop(L, 2);
+		goto skip;
+	}
+	key = lua_tostring(L, -2);
+	str = lua_tolstring(L, -1, &len);
+	if (!strcmp(key, "$oid")) {
+		bson_oid_t oid;
+		if (!bson_oid_is_valid(str, len)) goto skip;
+		bson_oid_init_from_string(&oid, str);
+		lua_pop(L, 3);
+		pushObjectID(L, &oid);
+		return true;
+	}
+	if (!len || strpbrk(str, "xXiInN") || (*str != '-' && !isDigit(*str))) goto skip; /* Leave special values to libbson */
+	errno = 0;
+	if (!strcmp(key, "$numberInt") || !strcmp(key, "$numberLong")) {
+		long long n = strtoll(str, &end, 10);
+		if (errno || end != str + len || (key[7] == 'I' && (n < INT32_MIN || n > INT32_MAX))) goto skip;
+		lua_pop(L, 3);
+		pushInt64(L, n);
+		return true;
+	}
+	if (!strcmp(key, "$numberDouble")) {
+		double n = strtod(str, &end);
+		if (end != str + len) goto skip;
+		lua_pop(L, 3);
+		lua_pushnumber(L, n);
+		return true;
+	}
+skip:
+	lua_pop(L, 2);
+	return false;
+}
+
+/* Replaces a table on top of the stack with the value of an Extended JSON wrapper it was parsed from */
+static void convertWrapper(lua_State *L, const char *str, size_t len) {
+	bson_t bson;
+	bson_iter_t iter;
+	bson_error_t error;
+	luaL_Buffer b;
+	bool ok;
+	if (convertSimple(L)) return;
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "{\"v\":");
+	luaL_addlstring(&b, str, len);
+	luaL_addchar(&b, '}');
+	luaL_pushresult(&b);
+	str = lua_tolstring(L, -1, &len);
+	ok = bson_init_from_json(&bson, str, len, &error);
+	lua_pop(L, 1);
+	if (!ok) return; /* Not a wrapper, e.g. a query operator */
+	if (bson_iter_init_find(&iter, &bson, "v") && bson_iter_type(&iter) != BSON_TYPE_DOCUMENT) {
+		lua_pop(L, 1);
+		pushBSONValue(L, bson_iter_value(&iter));
+	}
+	bson_destroy(&bson);
+}
+
+static void parseValue(Parser *p);
+
+static void parseObject(Parser *p) {
+	const char *start = p->pos;
+	bool wrapper = false;
+	int n = 0;
+	enterNested(p);
+	lua_newtable(p->L);
+	if (!skipChar(p, '}')) {
+		for (;;) {
+			if (!skipChar(p, '"')) parseError(p, "string expected");
+			if (!n++) wrapper = p->pos < p->end && *p->pos == '$'; /* Extended JSON wrappers start with '$' */
+			parseString(p);
+			if (!skipChar(p, ':')) parseError(p, "':' expected");
+			parseValue(p);
+			lua_rawset(p->L, -3);
+			if (skipChar(p, '}')) break;
+			if (!skipChar(p, ',')) parseError(p, "',' or '}' expected");
+		}
+	}
+	--p->depth;
+	if (wrapper) convertWrapper(p->L, start, p->pos - start);
+}
+
+static void parseArray(Parser *p) {
+	int n = 0;
+	enterNested(p);
+	lua_newtable(p->L);
+	if (!skipChar(p, ']')) {
+		for (;;) {
+			parseValue(p);
+			lua_rawseti(p->L, -2, ++n);
+			if (skipChar(p, ']')) break;
+			if (!skipChar(p, ',')) parseError(p, "',' or ']' expected");
+		}
+	}
+	--p->depth;
+	lua_pushinteger(p->L, n);
+	lua_setfield(p->L, -2, "__array");
+}
+
+static void parseValue(Parser *p) {
+	skipSpace(p);
+	if (p->pos == p->end) parseError(p, "unexpected end of input");
+	switch (*p->pos) {
+		case '{':
+			parseObject(p);
+			break;
+		case '[':
+			parseArray(p);
+			break;
+		case '"':
+			++p->pos;
+			parseString(p);
+			break;
+		case 't':
+			parseLiteral(p, "true", 4);
+			lua_pushboolean(p->L, 1);
+			break;
+		case 'f':
+			parseLiteral(p, "false", 5);
+			lua_pushboolean(p->L, 0);
+			break;
+		case 'n':
+			parseLiteral(p, "null", 4);
+			lua_rawgetp(p->L, LUA_REGISTRYINDEX, &GLOBAL_NULL);
+			break;
+		default:
+			parseNumber(p);
+			break;
+	}
+}
+
+int fromJSON(lua_State *L) {
+	Parser p;
+	size_t len;
+	p.L = L;
+	p.str = p.pos = luaL_checklstring(L, 1, &len);
+	p.end = p.str + len;
+	p.depth = 0;
+	lua_settop(L, 1);
+	parseValue(&p);
+	skipSpace(&p);
+	if (p.pos != p.end) parseError(&p, "unexpected character");
+	return 1;
+}
@@ -30,23 +30,37 @@ static int f_type(lua_State *L) {
 
 static const luaL_Reg funcs[] = {
 	{"type", f_type},
+	{"decompress", decompress},
+	{"fromJSON", fromJSON},
+	{"fromMsgPack", fromMsgPack},
+	{"parseJSONBatch", parseJSONBatch},
+	{"toJSON", toJSON},
+	{"trainDictionary", trainDictionary},
 	{"Binary", newBinary},
 	{"BSON", newBSON},
+	{"BSONFileWriter", newBSONFileWriter},
+	{"BSONReader", newBSONReader},
+	{"BSONWriter", newBSONWriter},
 	{"Client", newClient},
 	{"DateTime", newDateTime},
 	{"Decimal128", newDecimal128},
+	{"Dictionary", newDictionary},
 	{"Double", newDouble},
 	{"Int32", newInt32},
 	{"Int64", newInt64},
 	{"Javascript", newJavascript},
 	{"ObjectID", newObjectID},
+	{"Path", newPath},
 	{"ReadPrefs", newReadPrefs},
 	{"Regex", newRegex},
+	{"Schema", newSchema},
 	{"Timestamp", newTimestamp},
+	{"UnpackOptions", newUnpackOptions},
+	{"Vector", newVector},
 	{0, 0}
 };
 
-char NEW_BINARY, NEW_DATETIME, NEW_DECIMAL128, NEW_JAVASCRIPT, NEW_REGEX, NEW_TIMESTAMP;
+char NEW_JAVASCRIPT;
 char GLOBAL_MAXKEY, GLOBAL_MINKEY, GLOBAL_NULL;
 
 int luaopen_mongo(lua_State *L) {
@@ -61,18 +75,8 @@ int luaopen_mongo(lua_State *L) {
 	lua_setfield(L, -2, "_VERSION");
 
 	/* Cache BSON type constructors for quick access */
-	lua_getfield(L, -1, "Binary");
-	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_BINARY);
-	lua_getfield(L, -1, "DateTime");
-	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_DATETIME);
-	lua_getfield(L, -1, "Decimal128");
-	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_DECIMAL128);
 	lua_getfield(L, -1, "Javascript");
 	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_JAVASCRIPT);
-	lua_getfield(L, -1, "Regex");
-	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_REGEX);
-	lua_getfield(L, -1, "Timestamp");
-	lua_rawsetp(L, LUA_REGISTRYINDEX, &NEW_TIMESTAMP);
 
 	/* Create BSON type singletons */
 	pushMaxKey(L);
@@ -0,0 +1,136 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+typedef struct {
+	const char *key; /* Points into path string */
+	size_t len;
+} Segment;
+
+typedef struct {
+	int n; /* Number of segments */
+	Segment *segs; /* Stored right after the path */
+	char *str; /* Stored right after the segments */
+} Path;
+
+static Path *checkPath(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_PATH);
+}
+
+static bool findPath(const Path *path, const uint8_t *data, uint32_t len, bson_iter_t *iter) {
+	int i = 0;
+	if (!bson_iter_init_from_data(iter, data, len)) return false;
+	for (;;) {
+		bson_iter_t child;
+		if (!bson_iter_find_w_len(iter, path->segs[i].key, (int)path->segs[i].len)) return false;
+		if (++i == path->n) return true;
+		if ((!BSON_ITER_HOLDS_DOCUMENT(iter) && !BSON_ITER_HOLDS_ARRAY(iter)) || !bson_iter_recurse(iter, &child)) return false;
+		*iter = child;
+	}
+}
+
+static void pushValue(lua_State *L, const Path *path, int idx) {
+	bson_t *bson = testBSON(L, idx);
+	const uint8_t *data;
+	uint32_t len;
+	bson_iter_t iter;
+	if (bson) {
+		data = bson_get_data(bson);
+		len = bson->len;
+	} else if (!(data = testBSONView(L, idx, &len))) {
+		typeError(L, idx, TYPE_BSON " or " TYPE_BSONVIEW);
+		return;
+	}
+	if (!findPath(path, data, len, &iter)) {
+		lua_pushnil(L);
+		return;
+	}
+	switch (bson_iter_type(&iter)) {
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY:
+			if (BSON_ITER_HOLDS_ARRAY(&iter)) bson_iter_array(&iter, &len, &data);
+			else bson_iter_document(&iter, &len, &data);
+			pushBSONViewData(L, data, len, BSON_ITER_HOLDS_ARRAY(&iter), bson && !isBorrowedBSON(bson) ? 0 : idx); /* Mutable data is copied */
+			break;
+		default:
+			pushBSONValue(L, bson_iter_value(&iter));
+			break;
+	}
+}
+
+static int m_get(lua_State *L) {
+	pushValue(L, checkPath(L, 1), 2);
+	return 1;
+}
+
+static int m_getMany(lua_State *L) {
+	Path *path = checkPath(L, 1);
+	int i, n;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (int)lua_rawlen(L, 2);
+	lua_settop(L, 2);
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; ++i) {
+		lua_rawgeti(L, 2, i);
+		pushValue(L, path, 4);
+		lua_rawseti(L, 3, i);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int m__tostring(lua_State *L) {
+	lua_pushfstring(L, TYPE_PATH "(\"%s\")", checkPath(L, 1)->str);
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{"get", m_get},
+	{"getMany", m_getMany},
+	{"__tostring", m__tostring},
+	{0, 0}
+};
+
+int newPath(lua_State *L) {
+	size_t len;
+	const char *str = luaL_checklstring(L, 1, &len);
+	const char *dot;
+	int i, n = 1;
+	Path *path;
+	char *p;
+	for (dot = str; (dot = strchr(dot, '.')); ++dot) ++n;
+	path = lua_newuserdata(L, sizeof *path + n * sizeof *path->segs + len + 1);
+	path->n = n;
+	path->segs = (Segment *)(path + 1);
+	path->str = (char *)(path->segs + n);
+	memcpy(path->str, str, len + 1);
+	for (i = 0, p = path->str; i < n; ++i) {
+		size_t slen = (dot = strchr(p, '.')) ? (size_t)(dot - p) : strlen(p);
+		luaL_argcheck(L, slen, 1, "invalid path");
+		path->segs[i].key = p;
+		path->segs[i].len = slen;
+		p += slen + 1;
+	}
+	setType(L, TYPE_PATH, funcs);
+	return 1;
+}
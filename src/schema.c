@@ -0,0 +1,114 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+static const char *const names[] = {"any", "bool", "int32", "int64", "double", "string", "objectid", "datetime", "document", "array", 0};
+static const bson_type_t types[] = {BSON_TYPE_EOD, BSON_TYPE_BOOL, BSON_TYPE_INT32, BSON_TYPE_INT64, BSON_TYPE_DOUBLE, BSON_TYPE_UTF8, BSON_TYPE_OID, BSON_TYPE_DATE_TIME, BSON_TYPE_DOCUMENT, BSON_TYPE_ARRAY};
+
+static int m_fields(lua_State *L) {
+	Schema *schema = checkSchema(L, 1);
+	int i;
+	lua_createtable(L, schema->n, 0);
+	lua_getuservalue(L, 1);
+	for (i = 0; i < schema->n; ++i) {
+		lua_rawgeti(L, -1, i + 1);
+		lua_rawseti(L, -3, i + 1);
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+static int m__call(lua_State *L) {
+	checkSchema(L, 1);
+	luaL_checkany(L, 2);
+	pushBSONWithSchema(L, 2, 1);
+	return 1;
+}
+
+static int m__len(lua_State *L) {
+	lua_pushinteger(L, checkSchema(L, 1)->n);
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{"fields", m_fields},
+	{"__call", m__call},
+	{"__len", m__len},
+	{0, 0}
+};
+
+static int findType(lua_State *L, int idx) {
+	const char *name;
+	int i;
+	if (lua_isnil(L, idx)) return 0; /* Any */
+	name = lua_tostring(L, idx);
+	for (i = 0; name && names[i]; ++i) {
+		if (!strcmp(name, names[i])) return i;
+	}
+	return -1;
+}
+
+int newSchema(lua_State *L) {
+	Schema *schema;
+	int i, n;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_rawlen(L, 1);
+	lua_settop(L, 1);
+	schema = lua_newuserdata(L, sizeof *schema + n * sizeof *schema->fields);
+	schema->n = n;
+	lua_createtable(L, n * 2, 0); /* Keys followed by nested schemas */
+	for (i = 0; i < n; ++i) {
+		SchemaField *field = &schema->fields[i];
+		int t = 0;
+		lua_rawgeti(L, 1, i + 1); /* 4: field */
+		if (lua_istable(L, 4)) { /* Key with type */
+			lua_rawgeti(L, 4, 2); /* 5: type */
+			if (testSchema(L, 5)) { /* Nested schema */
+				lua_rawseti(L, 3, n + i + 1);
+				t = 8;
+			} else if ((t = findType(L, 5)) == -1) {
+				return argError(L, 1, "[%d] => invalid type", i + 1);
+			}
+			lua_rawgeti(L, 4, 1);
+			lua_replace(L, 4);
+			lua_settop(L, 4); /* Drop type name */
+		}
+		if (lua_type(L, 4) != LUA_TSTRING) return argError(L, 1, "[%d] => string key expected, got %s", i + 1, typeName(L, 4));
+		field->key = lua_tolstring(L, 4, &field->klen);
+		field->type = types[t];
+		field->tname = names[t];
+		lua_rawseti(L, 3, i + 1);
+		lua_settop(L, 3);
+	}
+	lua_setuservalue(L, 2);
+	setType(L, TYPE_SCHEMA, funcs);
+	return 1;
+}
+
+Schema *checkSchema(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_SCHEMA);
+}
+
+Schema *testSchema(lua_State *L, int idx) {
+	return luaL_testudata(L, idx, TYPE_SCHEMA);
+}
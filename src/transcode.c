@@ -0,0 +1,644 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+/*
+** Mapping of BSON types that have no native counterpart. Extension payloads follow BSON layout
+** except that strings are zero-terminated without a length prefix and integers are big-endian.
+**
+** BSON type    MessagePack          CBOR                 Payload
+** Binary       ext 5 (bin if 0x00)  tag 65541 (bytes)    subtype, data
+** Undefined    ext 6                undefined            (empty)
+** ObjectID     ext 7                tag 65543            12 bytes
+** DateTime     ext -1 (timestamp)   tag 1 (epoch)        -
+** Regex        ext 11               tag 65547            pattern, options
+** DBPointer    ext 12               tag 65548            collection, 12-byte ObjectID
+** Javascript   ext 13               tag 65549            code
+** Symbol       ext 14               tag 65550            symbol
+** Javascript   ext 15               tag 65551            code, scope document
+** (with scope)
+** Timestamp    ext 17               tag 65553            4-byte time, 4-byte increment
+** Decimal128   ext 19               tag 65555            16 bytes (little-endian as in BSON)
+** MinKey       ext 127              tag 65791            0xff (MessagePack only)
+** MaxKey       ext 127              tag 65663            0x7f (MessagePack only)
+*/
+
+#define CBOR_TAG 0x10000
+#define EXT_MINMAXKEY 127
+#define EXT_TIMESTAMP -1
+#define MAXDEPTH 100
+
+static void addBytes(Packer *p, const void *data, size_t len) {
+	luaL_addlstring(&p->b, data, len);
+	p->len += len;
+}
+
+static void addByte(Packer *p, uint8_t c) {
+	luaL_addchar(&p->b, c);
+	++p->len;
+}
+
+static void addBE(Packer *p, uint64_t val, int n) {
+	uint8_t buf[8];
+	int i;
+	for (i = n - 1; i >= 0; --i, val >>= 8) buf[i] = (uint8_t)val;
+	addBytes(p, buf, n);
+}
+
+/* Writes MessagePack header with the smallest of three length fields */
+static void addMsgPackHeader(Packer *p, uint8_t c8, uint8_t c16, uint8_t c32, uint32_t len) {
+	if (c8 && len <= UINT8_MAX) {
+		addByte(p, c8);
+		addBE(p, len, 1);
+	} else if (len <= UINT16_MAX) {
+		addByte(p, c16);
+		addBE(p, len, 2);
+	} else {
+		addByte(p, c32);
+		addBE(p, len, 4);
+	}
+}
+
+static void addCBORHeader(Packer *p, int major, uint64_t val) {
+	major <<= 5;
+	if (val < 24) addByte(p, major | (uint8_t)val);
+	else if (val <= UINT8_MAX) {
+		addByte(p, major | 24);
+		addBE(p, val, 1);
+	} else if (val <= UINT16_MAX) {
+		addByte(p, major | 25);
+		addBE(p, val, 2);
+	} else if (val <= UINT32_MAX) {
+		addByte(p, major | 26);
+		addBE(p, val, 4);
+	} else {
+		addByte(p, major | 27);
+		addBE(p, val, 8);
+	}
+}
+
+static void addInteger(Packer *p, int64_t val) {
+	if (p->cbor) {
+		if (val >= 0) addCBORHeader(p, 0, val);
+		else addCBORHeader(p, 1, -(uint64_t)(val + 1));
+	} else if (val >= 0) {
+		if (val < 0x80) addByte(p, (uint8_t)val);
+		else if (val <= UINT8_MAX) {
+			addByte(p, 0xcc);
+			addBE(p, val, 1);
+		} else if (val <= UINT16_MAX) {
+			addByte(p, 0xcd);
+			addBE(p, val, 2);
+		} else if (val <= UINT32_MAX) {
+			addByte(p, 0xce);
+			addBE(p, val, 4);
+		} else {
+			addByte(p, 0xcf);
+			addBE(p, val, 8);
+		}
+	} else if (val >= -32) addByte(p, (uint8_t)val);
+	else if (val >= INT8_MIN) {
+		addByte(p, 0xd0);
+		addBE(p, val, 1);
+	} else if (val >= INT16_MIN) {
+		addByte(p, 0xd1);
+		addBE(p, val, 2);
+	} else if (val >= INT32_MIN) {
+		addByte(p, 0xd2);
+		addBE(p, val, 4);
+	} else {
+		addByte(p, 0xd3);
+		addBE(p, val, 8);
+	}
+}
+
+static void addDouble(Packer *p, double val) {
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof bits);
+	addByte(p, p->cbor ? 0xfb : 0xcb);
+	addBE(p, bits, 8);
+}
+
+static void addString(Packer *p, const char *str, uint32_t len) {
+	if (p->cbor) addCBORHeader(p, 3, len);
+	else if (len < 32) addByte(p, 0xa0 | len);
+	else addMsgPackHeader(p, 0xd9, 0xda, 0xdb, len);
+	addBytes(p, str, len);
+}
+
+static void addBinary(Packer *p, const uint8_t *data, uint32_t len) {
+	if (p->cbor) addCBORHeader(p, 2, len);
+	else addMsgPackHeader(p, 0xc4, 0xc5, 0xc6, len);
+	addBytes(p, data, len);
+}
+
+static void addContainer(Packer *p, uint32_t n, bool array) {
+	if (p->cbor) addCBORHeader(p, array ? 4 : 5, n);
+	else if (n < 16) addByte(p, (array ? 0x90 : 0x80) | n);
+	else if (array) addMsgPackHeader(p, 0, 0xdc, 0xdd, n);
+	else addMsgPackHeader(p, 0, 0xde, 0xdf, n);
+}
+
+/* Writes header of an extension (MessagePack) or a tagged byte string (CBOR) */
+static void addExtension(Packer *p, int type, uint32_t len) {
+	if (p->cbor) {
+		addCBORHeader(p, 6, CBOR_TAG + (type & 0xff));
+		addCBORHeader(p, 2, len);
+		return;
+	}
+	switch (len) {
+		case 1:
+			addByte(p, 0xd4);
+			break;
+		case 2:
+			addByte(p, 0xd5);
+			break;
+		case 4:
+			addByte(p, 0xd6);
+			break;
+		case 8:
+			addByte(p, 0xd7);
+			break;
+		case 16:
+			addByte(p, 0xd8);
+			break;
+		default:
+			addMsgPackHeader(p, 0xc7, 0xc8, 0xc9, len);
+			break;
+	}
+	addByte(p, (uint8_t)type);
+}
+
+static void addDateTime(Packer *p, int64_t val) {
+	int64_t sec = val / 1000, ms = val % 1000;
+	if (ms < 0) {
+		--sec;
+		ms += 1000;
+	}
+	if (p->cbor) {
+		addCBORHeader(p, 6, 1);
+		if (ms) addDouble(p, val / 1000.0);
+		else addInteger(p, sec);
+	} else if (!ms && sec >= 0 && sec <= UINT32_MAX) { /* timestamp 32 */
+		addExtension(p, EXT_TIMESTAMP, 4);
+		addBE(p, sec, 4);
+	} else if (sec >= 0 && sec < INT64_C(0x400000000)) { /* timestamp 64 */
+		addExtension(p, EXT_TIMESTAMP, 8);
+		addBE(p, (uint64_t)(ms * 1000000) << 34 | sec, 8);
+	} else { /* timestamp 96 */
+		addExtension(p, EXT_TIMESTAMP, 12);
+		addBE(p, ms * 1000000, 4);
+		addBE(p, sec, 8);
+	}
+}
+
+static void addDocument(Packer *p, const bson_iter_t *iter, bool array, int depth);
+
+static void addValue(Packer *p, const bson_iter_t *iter, int depth) {
+	uint32_t len;
+	switch (bson_iter_type(iter)) {
+		case BSON_TYPE_DOUBLE:
+			addDouble(p, bson_iter_double(iter));
+			break;
+		case BSON_TYPE_UTF8: {
+			const char *str = bson_iter_utf8(iter, &len);
+			addString(p, str, len);
+			break;
+		}
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY: {
+			bson_iter_t child;
+			if (depth >= MAXDEPTH) luaL_error(p->b.L, "document nesting too deep");
+			if (!bson_iter_recurse(iter, &child)) luaL_error(p->b.L, "corrupt BSON document");
+			addDocument(p, &child, bson_iter_type(iter) == BSON_TYPE_ARRAY, depth + 1);
+			break;
+		}
+		case BSON_TYPE_BINARY: {
+			bson_subtype_t subtype;
+			const uint8_t *data;
+			bson_iter_binary(iter, &subtype, &len, &data);
+			if (subtype == BSON_SUBTYPE_BINARY) {
+				addBinary(p, data, len);
+				break;
+			}
+			addExtension(p, BSON_TYPE_BINARY, len + 1);
+			addByte(p, (uint8_t)subtype);
+			addBytes(p, data, len);
+			break;
+		}
+		case BSON_TYPE_UNDEFINED:
+			if (p->cbor) addByte(p, 0xf7);
+			else addExtension(p, BSON_TYPE_UNDEFINED, 0);
+			break;
+		case BSON_TYPE_OID:
+			addExtension(p, BSON_TYPE_OID, 12);
+			addBytes(p, bson_iter_oid(iter)->bytes, 12);
+			break;
+		case BSON_TYPE_BOOL:
+			addByte(p, bson_iter_bool(iter) ? (p->cbor ? 0xf5 : 0xc3) : (p->cbor ? 0xf4 : 0xc2));
+			break;
+		case BSON_TYPE_DATE_TIME:
+			addDateTime(p, bson_iter_date_time(iter));
+			break;
+		case BSON_TYPE_NULL:
+			addByte(p, p->cbor ? 0xf6 : 0xc0);
+			break;
+		case BSON_TYPE_REGEX: {
+			const char *options, *regex = bson_iter_regex(iter, &options);
+			size_t rlen = strlen(regex) + 1, olen = strlen(options) + 1;
+			addExtension(p, BSON_TYPE_REGEX, (uint32_t)(rlen + olen));
+			addBytes(p, regex, rlen);
+			addBytes(p, options, olen);
+			break;
+		}
+		case BSON_TYPE_DBPOINTER: {
+			const char *str;
+			const bson_oid_t *oid;
+			bson_iter_dbpointer(iter, &len, &str, &oid);
+			addExtension(p, BSON_TYPE_DBPOINTER, len + 13);
+			addBytes(p, str, len + 1);
+			addBytes(p, oid->bytes, 12);
+			break;
+		}
+		case BSON_TYPE_CODE: {
+			const char *str = bson_iter_code(iter, &len);
+			addExtension(p, BSON_TYPE_CODE, len + 1);
+			addBytes(p, str, len + 1);
+			break;
+		}
+		case BSON_TYPE_SYMBOL: {
+			const char *str = bson_iter_symbol(iter, &len);
+			addExtension(p, BSON_TYPE_SYMBOL, len + 1);
+			addBytes(p, str, len + 1);
+			break;
+		}
+		case BSON_TYPE_CODEWSCOPE: {
+			uint32_t slen;
+			const uint8_t *scope;
+			const char *str = bson_iter_codewscope(iter, &len, &slen, &scope);
+			addExtension(p, BSON_TYPE_CODEWSCOPE, len + 1 + slen);
+			addBytes(p, str, len + 1);
+			addBytes(p, scope, slen);
+			break;
+		}
+		case BSON_TYPE_INT32:
+			addInteger(p, bson_iter_int32(iter));
+			break;
+		case BSON_TYPE_TIMESTAMP: {
+			uint32_t t, i;
+			bson_iter_timestamp(iter, &t, &i);
+			addExtension(p, BSON_TYPE_TIMESTAMP, 8);
+			addBE(p, t, 4);
+			addBE(p, i, 4);
+			break;
+		}
+		case BSON_TYPE_INT64:
+			addInteger(p, bson_iter_int64(iter));
+			break;
+		case BSON_TYPE_DECIMAL128: {
+			bson_decimal128_t dec;
+			uint8_t buf[16];
+			int i;
+			bson_iter_decimal128(iter, &dec);
+			for (i = 0; i < 8; ++i) {
+				buf[i] = (uint8_t)(dec.low >> (i * 8));
+				buf[i + 8] = (uint8_t)(dec.high >> (i * 8));
+			}
+			addExtension(p, BSON_TYPE_DECIMAL128, 16);
+			addBytes(p, buf, 16);
+			break;
+		}
+		case BSON_TYPE_MAXKEY:
+		case BSON_TYPE_MINKEY:
+			if (p->cbor) addExtension(p, bson_iter_type(iter), 0);
+			else {
+				addExtension(p, EXT_MINMAXKEY, 1);
+				addByte(p, (uint8_t)bson_iter_type(iter));
+			}
+			break;
+		default:
+			luaL_error(p->b.L, "corrupt BSON document");
+	}
+}
+
+static void addDocument(Packer *p, const bson_iter_t *iter, bool array, int depth) {
+	bson_iter_t it = *iter;
+	uint32_t n = 0;
+	while (bson_iter_next(&it)) ++n;
+	addContainer(p, n, array);
+	it = *iter;
+	while (bson_iter_next(&it)) {
+		if (!array) addString(p, bson_iter_key(&it), bson_iter_key_len(&it));
+		addValue(p, &it, depth);
+	}
+}
+
+void initPacker(lua_State *L, Packer *p, bool cbor) {
+	luaL_buffinit(L, &p->b);
+	p->len = 0;
+	p->cbor = cbor;
+}
+
+void appendPacked(Packer *p, const uint8_t *data, uint32_t len, bool array) {
+	bson_iter_t iter;
+	if (!bson_iter_init_from_data(&iter, data, len)) luaL_error(p->b.L, "corrupt BSON document");
+	addDocument(p, &iter, array, 0);
+}
+
+/*
+** MessagePack input
+*/
+
+typedef struct {
+	const uint8_t *str, *pos, *end;
+	const char *error;
+} Unpacker;
+
+static bool fail(Unpacker *u, const char *error) {
+	u->error = error;
+	return false;
+}
+
+static bool readBE(Unpacker *u, int n, uint64_t *val) {
+	if (u->end - u->pos < n) return fail(u, "unexpected end of data");
+	for (*val = 0; n--; ++u->pos) *val = *val << 8 | *u->pos;
+	return true;
+}
+
+static bool readData(Unpacker *u, uint64_t len, const uint8_t **data) {
+	if ((uint64_t)(u->end - u->pos) < len) return fail(u, "unexpected end of data");
+	if (len > INT32_MAX) return fail(u, "value too large");
+	*data = u->pos;
+	u->pos += len;
+	return true;
+}
+
+static bool appendInteger(bson_t *bson, const char *key, int klen, int64_t val) {
+	if (val >= INT32_MIN && val <= INT32_MAX) return bson_append_int32(bson, key, klen, (int32_t)val);
+	return bson_append_int64(bson, key, klen, val);
+}
+
+static bool isString(const uint8_t *data, uint32_t len) { /* Zero-terminated string without inner zeros */
+	return len && !data[len - 1] && strlen((const char *)data) == len - 1;
+}
+
+static bool readExtension(Unpacker *u, bson_t *bson, const char *key, int klen, int8_t type, uint32_t len) {
+	const uint8_t *data;
+	size_t n;
+	if (!readData(u, len, &data)) return false;
+	switch (type) {
+		case EXT_TIMESTAMP: {
+			uint64_t sec = 0, ns = 0;
+			int i;
+			if (len == 4) {
+				for (i = 0; i < 4; ++i) sec = sec << 8 | data[i];
+			} else if (len == 8) {
+				for (i = 0; i < 8; ++i) sec = sec << 8 | data[i];
+				ns = sec >> 34;
+				sec &= INT64_C(0x3ffffffff);
+			} else if (len == 12) {
+				for (i = 0; i < 4; ++i) ns = ns << 8 | data[i];
+				for (i = 4; i < 12; ++i) sec = sec << 8 | data[i];
+			} else break;
+			return bson_append_date_time(bson, key, klen, (int64_t)sec * 1000 + (int64_t)(ns / 1000000));
+		}
+		case BSON_TYPE_BINARY:
+			if (!len) break;
+			return bson_append_binary(bson, key, klen, data[0], data + 1, len - 1);
+		case BSON_TYPE_UNDEFINED:
+			return bson_append_undefined(bson, key, klen);
+		case BSON_TYPE_OID:
+			if (len != 12) break;
+			return bson_append_oid(bson, key, klen, (const bson_oid_t *)data);
+		case BSON_TYPE_REGEX:
+			if (!len || data[len - 1] || (n = strlen((const char *)data) + 1) == len || !isString(data + n, len - n)) break;
+			return bson_append_regex(bson, key, klen, (const char *)data, (const char *)data + n);
+		case BSON_TYPE_DBPOINTER:
+			if (len < 13 || !isString(data, len - 12)) break;
+			return bson_append_dbpointer(bson, key, klen, (const char *)data, (const bson_oid_t *)(data + len - 12));
+		case BSON_TYPE_CODE:
+			if (!isString(data, len)) break;
+			return bson_append_code(bson, key, klen, (const char *)data);
+		case BSON_TYPE_SYMBOL:
+			if (!isString(data, len)) break;
+			return bson_append_symbol(bson, key, klen, (const char *)data, len - 1);
+		case BSON_TYPE_CODEWSCOPE: {
+			const uint8_t *end = memchr(data, 0, len);
+			bson_t scope;
+			if (!end || !bson_init_static(&scope, end + 1, len - (end + 1 - data))) break;
+			return bson_append_code_with_scope(bson, key, klen, (const char *)data, &scope);
+		}
+		case BSON_TYPE_TIMESTAMP: {
+			uint32_t t = 0, i = 0;
+			int j;
+			if (len != 8) break;
+			for (j = 0; j < 4; ++j) {
+				t = t << 8 | data[j];
+				i = i << 8 | data[j + 4];
+			}
+			return bson_append_timestamp(bson, key, klen, t, i);
+		}
+		case BSON_TYPE_DECIMAL128: {
+			bson_decimal128_t dec;
+			int i;
+			if (len != 16) break;
+			dec.low = dec.high = 0;
+			for (i = 7; i >= 0; --i) {
+				dec.low = dec.low << 8 | data[i];
+				dec.high = dec.high << 8 | data[i + 8];
+			}
+			return bson_append_decimal128(bson, key, klen, &dec);
+		}
+		case EXT_MINMAXKEY:
+			if (len != 1) break;
+			if (data[0] == BSON_TYPE_MINKEY) return bson_append_minkey(bson, key, klen);
+			if (data[0] == BSON_TYPE_MAXKEY) return bson_append_maxkey(bson, key, klen);
+			break;
+		default:
+			return fail(u, "unsupported extension type");
+	}
+	return fail(u, "invalid extension data");
+}
+
+static bool readContainer(Unpacker *u, bson_t *bson, uint32_t n, bool array, int depth);
+
+static bool readValue(Unpacker *u, bson_t *bson, const char *key, int klen, int depth) {
+	uint8_t c;
+	uint64_t val;
+	const uint8_t *data;
+	if (u->pos == u->end) return fail(u, "unexpected end of data");
+	c = *u->pos++;
+	if (c < 0x80) return appendInteger(bson, key, klen, c);
+	if (c >= 0xe0) return appendInteger(bson, key, klen, (int8_t)c);
+	if (c < 0x90 || (c >= 0xde && c <= 0xdf)) { /* Map */
+		bson_t child;
+		if (c < 0x90) val = c & 0x0f;
+		else if (!readBE(u, c == 0xde ? 2 : 4, &val)) return false;
+		if (depth >= MAXDEPTH) return fail(u, "nesting too deep");
+		bson_append_document_begin(bson, key, klen, &child);
+		if (!readContainer(u, &child, (uint32_t)val, false, depth + 1)) return false;
+		return bson_append_document_end(bson, &child);
+	}
+	if (c < 0xa0 || (c >= 0xdc && c <= 0xdd)) { /* Array */
+		bson_t child;
+		if (c < 0xa0) val = c & 0x0f;
+		else if (!readBE(u, c == 0xdc ? 2 : 4, &val)) return false;
+		if (depth >= MAXDEPTH) return fail(u, "nesting too deep");
+		bson_append_array_begin(bson, key, klen, &child);
+		if (!readContainer(u, &child, (uint32_t)val, true, depth + 1)) return false;
+		return bson_append_array_end(bson, &child);
+	}
+	if (c < 0xc0 || (c >= 0xd9 && c <= 0xdb)) { /* String */
+		if (c < 0xc0) val = c & 0x1f;
+		else if (!readBE(u, 1 << (c - 0xd9), &val)) return false;
+		if (!readData(u, val, &data)) return false;
+		return bson_append_utf8(bson, key, klen, (const char *)data, (int)val);
+	}
+	switch (c) {
+		case 0xc0:
+			return bson_append_null(bson, key, klen);
+		case 0xc2:
+		case 0xc3:
+			return bson_append_bool(bson, key, klen, c == 0xc3);
+		case 0xc4:
+		case 0xc5:
+		case 0xc6:
+			if (!readBE(u, 1 << (c - 0xc4), &val) || !readData(u, val, &data)) return false;
+			return bson_append_binary(bson, key, klen, BSON_SUBTYPE_BINARY, data, (uint32_t)val);
+		case 0xc7:
+		case 0xc8:
+		case 0xc9:
+			if (!readBE(u, 1 << (c - 0xc7), &val) || !readData(u, 1, &data)) return false;
+			return readExtension(u, bson, key, klen, (int8_t)data[0], (uint32_t)val);
+		case 0xca: {
+			float f;
+			uint32_t bits;
+			if (!readBE(u, 4, &val)) return false;
+			bits = (uint32_t)val;
+			memcpy(&f, &bits, sizeof f);
+			return bson_append_double(bson, key, klen, f);
+		}
+		case 0xcb: {
+			double d;
+			if (!readBE(u, 8, &val)) return false;
+			memcpy(&d, &val, sizeof d);
+			return bson_append_double(bson, key, klen, d);
+		}
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			if (!readBE(u, 1 << (c - 0xcc), &val)) return false;
+			if (val > INT64_MAX) return bson_append_double(bson, key, klen, (double)val);
+			return appendInteger(bson, key, klen, (int64_t)val);
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3: {
+			int n = 1 << (c - 0xd0);
+			if (!readBE(u, n, &val)) return false;
+			if (n < 8 && (val >> (n * 8 - 1))) val |= ~UINT64_C(0) << (n * 8); /* Sign extension */
+			return appendInteger(bson, key, klen, (int64_t)val);
+		}
+		case 0xd4:
+		case 0xd5:
+		case 0xd6:
+		case 0xd7:
+		case 0xd8:
+			if (!readData(u, 1, &data)) return false;
+			return readExtension(u, bson, key, klen, (int8_t)data[0], 1 << (c - 0xd4));
+		default:
+			return fail(u, "invalid type");
+	}
+}
+
+static bool readContainer(Unpacker *u, bson_t *bson, uint32_t n, bool array, int depth) {
+	uint32_t i;
+	for (i = 0; i < n; ++i) {
+		char buf[16];
+		const char *key;
+		int klen;
+		if (array) klen = (int)bson_uint32_to_string(i, &key, buf, sizeof buf);
+		else {
+			uint8_t c;
+			uint64_t len;
+			const uint8_t *data;
+			if (u->pos == u->end) return fail(u, "unexpected end of data");
+			c = *u->pos++;
+			if (c >= 0xa0 && c < 0xc0) len = c & 0x1f;
+			else if (c < 0xd9 || c > 0xdb) return fail(u, "string key expected");
+			else if (!readBE(u, 1 << (c - 0xd9), &len)) return false;
+			if (!readData(u, len, &data)) return false;
+			if (memchr(data, 0, len)) return fail(u, "invalid key");
+			key = (const char *)data;
+			klen = (int)len;
+		}
+		if (!readValue(u, bson, key, klen, depth)) {
+			if (!u->error) fail(u, "document too large");
+			return false;
+		}
+	}
+	return true;
+}
+
+int fromMsgPack(lua_State *L) {
+	size_t len;
+	const char *str = luaL_checklstring(L, 1, &len);
+	Unpacker u;
+	bson_t bson;
+	bson_error_t error;
+	uint64_t n;
+	uint8_t c;
+	bool array, ok;
+	int flags = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		flags = toValidateFlags(L, 2);
+	}
+	u.str = u.pos = (const uint8_t *)str;
+	u.end = u.pos + len;
+	u.error = 0;
+	if (!len) return argError(L, 1, "invalid MessagePack at offset 0: unexpected end of data");
+	c = *u.pos++;
+	array = (c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd;
+	if ((c & 0xf0) == 0x80 || (c & 0xf0) == 0x90) n = c & 0x0f;
+	else if (c >= 0xdc && c <= 0xdf) {
+		if (!readBE(&u, c & 1 ? 4 : 2, &n)) n = 0;
+	} else {
+		--u.pos;
+		fail(&u, "map or array expected");
+	}
+	bson_init(&bson);
+	ok = !u.error && readContainer(&u, &bson, (uint32_t)n, array, 0);
+	if (ok && u.pos != u.end) ok = fail(&u, "trailing data");
+	if (!ok) {
+		bson_destroy(&bson);
+		return argError(L, 1, "invalid MessagePack at offset %d: %s", (int)(u.pos - u.str), u.error);
+	}
+	if (flags && !validateBSON(&bson, flags, &error)) {
+		bson_destroy(&bson);
+		return argError(L, 1, "%s", error.message);
+	}
+	pushBSONWithSteal(L, &bson);
+	return 1;
+}
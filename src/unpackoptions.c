@@ -0,0 +1,210 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+static void freeProjection(lua_State *L, Projection *node) {
+	while (node) {
+		Projection *next = node->next;
+		freeProjection(L, node->child);
+		if (node->handler > 0) luaL_unref(L, LUA_REGISTRYINDEX, node->handler);
+		bson_free(node->key);
+		bson_free(node);
+		node = next;
+	}
+}
+
+static Projection *addChild(Projection *node, const char *key, size_t klen) {
+	Projection *child;
+	bool any = klen == 1 && (*key == '$' || *key == '*');
+	for (child = node->child; child; child = child->next) {
+		if (any ? !child->key : child->key && child->klen == klen && !memcmp(child->key, key, klen)) return child;
+	}
+	child = bson_malloc0(sizeof *child);
+	if (!any) {
+		child->key = bson_strndup(key, klen);
+		child->klen = klen;
+	}
+	child->next = node->child;
+	node->child = child;
+	return child;
+}
+
+static Projection *addPath(Projection *root, const char *path) {
+	Projection *node = root;
+	for (;;) {
+		const char *dot = strchr(path, '.');
+		size_t len = dot ? (size_t)(dot - path) : strlen(path);
+		if (!len) return 0;
+		if (node->all) return node; /* Already selected */
+		node = addChild(node, path, len);
+		if (!dot) return node;
+		path = dot + 1;
+	}
+}
+
+static void compileFields(lua_State *L, int idx, UnpackOptions *opts) {
+	lua_Integer i;
+	luaL_argcheck(L, lua_istable(L, -1), idx, "table expected for 'fields'");
+	opts->fields = bson_malloc0(sizeof *opts->fields);
+	for (i = 1;; ++i) {
+		Projection *node;
+		lua_rawgeti(L, -1, i);
+		if (lua_isnil(L, -1)) break;
+		if (lua_type(L, -1) != LUA_TSTRING || !(node = addPath(opts->fields, lua_tostring(L, -1)))) argError(L, idx, "invalid field path in 'fields'");
+		node->all = true;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2); /* Sentinel and fields */
+}
+
+static void compileHandlers(lua_State *L, int idx, UnpackOptions *opts) {
+	luaL_argcheck(L, lua_istable(L, -1), idx, "table expected for 'handlers'");
+	opts->handlers = bson_malloc0(sizeof *opts->handlers);
+	for (lua_pushnil(L); lua_next(L, -2);) {
+		const char *path = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : 0;
+		Projection *node = !path ? 0 : *path ? addPath(opts->handlers, path) : opts->handlers; /* Empty path denotes root */
+		if (!node) argError(L, idx, "invalid path in 'handlers'");
+		if (lua_isboolean(L, -1) && !lua_toboolean(L, -1) && node != opts->handlers) {
+			node->handler = HANDLER_SKIP;
+			lua_pop(L, 1);
+		} else {
+			bool callable = lua_isfunction(L, -1);
+			if (!callable && luaL_getmetafield(L, -1, "__call")) { /* Callable object */
+				callable = lua_isfunction(L, -1);
+				lua_pop(L, 1);
+			}
+			if (!callable) argError(L, idx, "invalid handler for '%s'", path);
+			node->handler = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+static const char *const profiles[] = {"default", "raw", 0};
+static const char *const objectIds[] = {"object", "hex", "bytes", 0};
+
+static int getOption(lua_State *L, int idx, const char *name, const char *const list[], int def) {
+	const char *str;
+	int i;
+	lua_getfield(L, idx, name);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return def;
+	}
+	if ((str = lua_tostring(L, -1))) {
+		for (i = 0; list[i]; ++i) {
+			if (!strcmp(list[i], str)) {
+				lua_pop(L, 1);
+				return i;
+			}
+		}
+	}
+	return argError(L, idx, "invalid value for '%s'", name);
+}
+
+static bool getFlag(lua_State *L, int idx, const char *name, const char *value, bool def) {
+	const char *const list[] = {"default", value, 0};
+	return getOption(L, idx, name, list, def) == 1;
+}
+
+static void compileProfile(lua_State *L, int idx, UnpackOptions *opts) {
+	bool raw = getOption(L, idx, "profile", profiles, 0) == 1;
+	opts->rawDates = getFlag(L, idx, "dates", "int", raw);
+	opts->rawTimestamps = getFlag(L, idx, "timestamps", "int", raw);
+	opts->rawBinaries = getFlag(L, idx, "binaries", "string", raw);
+	opts->rawDecimals = getFlag(L, idx, "decimals", "string", raw);
+	opts->objectIds = getOption(L, idx, "objectIds", objectIds, raw ? OID_BYTES : 0);
+	lua_getfield(L, idx, "arrayLength");
+	opts->noArrayLength = lua_isnil(L, -1) ? raw : !lua_toboolean(L, -1);
+	lua_pop(L, 1);
+}
+
+static int m__gc(lua_State *L) {
+	UnpackOptions *opts = luaL_checkudata(L, 1, TYPE_UNPACKOPTIONS);
+	freeProjection(L, opts->fields);
+	freeProjection(L, opts->handlers);
+	opts->fields = 0;
+	opts->handlers = 0;
+	if (opts->into) luaL_unref(L, LUA_REGISTRYINDEX, opts->into);
+	opts->into = 0;
+	return 0;
+}
+
+static const luaL_Reg funcs[] = {
+	{"__gc", m__gc},
+	{0, 0}
+};
+
+UnpackOptions *toUnpackOptions(lua_State *L, int idx) {
+	UnpackOptions *opts;
+	if (lua_isnoneornil(L, idx)) return 0;
+	if ((opts = luaL_testudata(L, idx, TYPE_UNPACKOPTIONS))) return opts; /* Already compiled */
+	luaL_checktype(L, idx, LUA_TTABLE);
+	opts = lua_newuserdata(L, sizeof *opts); /* Collected on error */
+	memset(opts, 0, sizeof *opts);
+	setType(L, TYPE_UNPACKOPTIONS, funcs);
+	lua_getfield(L, idx, "vectors");
+	opts->vectors = lua_toboolean(L, -1);
+	lua_getfield(L, idx, "numericArrays");
+	if (!lua_isnil(L, -1)) {
+		const char *name = lua_tostring(L, -1);
+		if (!name || !(opts->arrays = toVectorType(name)) || opts->arrays == VECTOR_PACKED_BIT) argError(L, idx, "invalid value for 'numericArrays'");
+	}
+	lua_pop(L, 2);
+	compileProfile(L, idx, opts);
+	opts->validate = toValidateFlags(L, idx);
+	lua_getfield(L, idx, "fields");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_getfield(L, idx, "decodeFields"); /* Cursor-level spelling */
+	}
+	if (lua_isnil(L, -1)) lua_pop(L, 1);
+	else compileFields(L, idx, opts);
+	lua_getfield(L, idx, "handlers");
+	if (lua_isnil(L, -1)) lua_pop(L, 1);
+	else compileHandlers(L, idx, opts);
+	lua_getfield(L, idx, "into");
+	if (lua_isnil(L, -1)) lua_pop(L, 1);
+	else {
+		luaL_argcheck(L, lua_istable(L, -1), idx, "table expected for 'into'");
+		opts->into = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_replace(L, idx);
+	return opts;
+}
+
+int newUnpackOptions(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	toUnpackOptions(L, 1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+const Projection *findProjection(const Projection *node, const char *key, size_t klen) {
+	const Projection *any = 0;
+	for (node = node->child; node; node = node->next) {
+		if (!node->key) any = node;
+		else if (node->klen == klen && !memcmp(node->key, key, klen)) return node;
+	}
+	return any;
+}
@@ -0,0 +1,165 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+
+#define ONES UINT64_C(0x0101010101010101)
+#define HIGHS UINT64_C(0x8080808080808080)
+#define MAXDEPTH 200 /* Nesting limit */
+
+bool isValidUTF8(const char *str, size_t len) {
+	const unsigned char *pos = (const unsigned char *)str, *end = pos + len;
+	while (pos < end) {
+		uint32_t c;
+		uint64_t w;
+		int n;
+		if (end - pos >= 8) { /* Skip 8 ASCII characters at a time */
+			memcpy(&w, pos, sizeof w);
+			if (!(w & HIGHS)) {
+				pos += 8;
+				continue;
+			}
+		}
+		c = *pos++;
+		if (c < 0x80) continue;
+		if (c < 0xc2) return false; /* Continuation byte or overlong 2-byte sequence */
+		if (c < 0xe0) {
+			n = 1;
+			c &= 0x1f;
+		} else if (c < 0xf0) {
+			n = 2;
+			c &= 0x0f;
+		} else if (c < 0xf5) {
+			n = 3;
+			c &= 0x07;
+		} else return false;
+		if (end - pos < n) return false;
+		switch (n) {
+			case 3:
+				if ((*pos & 0xc0) != 0x80) return false;
+				c = c << 6 | (*pos++ & 0x3f);
+				if (c < 0x10 || c > 0x10f) return false; /* Overlong or beyond U+10FFFF */
+			/* Fall through */
+			case 2:
+				if ((*pos & 0xc0) != 0x80) return false;
+				c = c << 6 | (*pos++ & 0x3f);
+				if (n == 2 && (c < 0x20 || (c >= 0x360 && c < 0x380))) return false; /* Overlong or surrogate */
+			/* Fall through */
+			default:
+				if ((*pos & 0xc0) != 0x80) return false;
+				++pos;
+		}
+	}
+	return true;
+}
+
+static bool validateKey(const bson_iter_t *iter, int flags, bson_error_t *error) {
+	const char *key = bson_iter_key(iter);
+	if ((flags & VALIDATE_UTF8) && !isValidUTF8(key, bson_iter_key_len(iter))) {
+		bson_set_error(error, 0, 0, "invalid UTF-8 key");
+		return false;
+	}
+	if ((flags & VALIDATE_KEYS) && (*key == '$' || strchr(key, '.'))) {
+		bson_set_error(error, 0, 0, "invalid key '%s'", key);
+		return false;
+	}
+	return true;
+}
+
+static bool validateString(const bson_iter_t *iter, const char *str, size_t len, bson_error_t *error) {
+	if (isValidUTF8(str, len)) return true;
+	bson_set_error(error, 0, 0, "invalid UTF-8 string in field '%s'", bson_iter_key(iter));
+	return false;
+}
+
+static bool validateIter(bson_iter_t *iter, int flags, bool array, int depth, bson_error_t *error) {
+	while (bson_iter_next(iter)) {
+		bson_iter_t child;
+		const char *str, *opts;
+		uint32_t len, slen;
+		const uint8_t *scope;
+		bson_t doc;
+		if (!array && !validateKey(iter, flags, error)) return false;
+		switch (bson_iter_type(iter)) {
+			case BSON_TYPE_UTF8:
+				str = bson_iter_utf8(iter, &len);
+				if (flags & VALIDATE_UTF8 && !validateString(iter, str, len, error)) return false;
+				break;
+			case BSON_TYPE_CODE:
+				str = bson_iter_code(iter, &len);
+				if (flags & VALIDATE_UTF8 && !validateString(iter, str, len, error)) return false;
+				break;
+			case BSON_TYPE_SYMBOL:
+				str = bson_iter_symbol(iter, &len);
+				if (flags & VALIDATE_UTF8 && !validateString(iter, str, len, error)) return false;
+				break;
+			case BSON_TYPE_REGEX:
+				str = bson_iter_regex(iter, &opts);
+				if (flags & VALIDATE_UTF8 && !validateString(iter, str, strlen(str), error)) return false;
+				break;
+			case BSON_TYPE_CODEWSCOPE: /* Scope keys are not subject to key checks */
+				str = bson_iter_codewscope(iter, &len, &slen, &scope);
+				if (flags & VALIDATE_UTF8 && !validateString(iter, str, len, error)) return false;
+				if (!bson_init_static(&doc, scope, slen) || !bson_iter_init(&child, &doc)) goto corrupt;
+				if (!validateIter(&child, flags & ~VALIDATE_KEYS, false, depth + 1, error)) return false;
+				break;
+			case BSON_TYPE_DOCUMENT:
+			case BSON_TYPE_ARRAY:
+				if (depth >= MAXDEPTH) {
+					bson_set_error(error, 0, 0, "document is too deeply nested");
+					return false;
+				}
+				if (!bson_iter_recurse(iter, &child)) goto corrupt;
+				if (!validateIter(&child, flags, BSON_ITER_HOLDS_ARRAY(iter), depth + 1, error)) return false;
+				break;
+			default:
+				break;
+		}
+	}
+	if (!iter->err_off) return true;
+corrupt:
+	bson_set_error(error, 0, 0, "corrupt BSON");
+	return false;
+}
+
+bool validateBSON(const bson_t *bson, int flags, bson_error_t *error) {
+	bson_iter_t iter;
+	if (!bson_iter_init(&iter, bson)) {
+		bson_set_error(error, 0, 0, "corrupt BSON");
+		return false;
+	}
+	return validateIter(&iter, flags, false, 0, error);
+}
+
+int toValidateFlags(lua_State *L, int idx) {
+	const char *level;
+	int flags = 0;
+	lua_getfield(L, idx, "validate");
+	if (lua_isboolean(L, -1)) flags = lua_toboolean(L, -1) ? VALIDATE_UTF8 : 0;
+	else if ((level = lua_tostring(L, -1))) {
+		if (!strcmp(level, "utf8")) flags = VALIDATE_UTF8;
+		else if (!strcmp(level, "keys")) flags = VALIDATE_UTF8 | VALIDATE_KEYS;
+		else if (strcmp(level, "none")) argError(L, idx, "invalid value for 'validate'");
+	} else luaL_argcheck(L, lua_isnil(L, -1), idx, "invalid value for 'validate'");
+	lua_pop(L, 1);
+	return flags;
+}
@@ -0,0 +1,272 @@
+/*
+** Copyright (C) 2016-2021 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "common.h"
+#include <float.h>
+#include <math.h>
+
+static const char *const names[] = {"float32", "int8", "packed_bit", 0};
+static const int types[] = {VECTOR_FLOAT32, VECTOR_INT8, VECTOR_PACKED_BIT};
+
+static const char *getTypeName(int type) {
+	int i;
+	for (i = 0; names[i]; ++i) {
+		if (types[i] == type) return names[i];
+	}
+	return "unknown";
+}
+
+static float getFloat(const uint8_t *p) {
+	uint32_t u;
+	float f;
+	memcpy(&u, p, sizeof u);
+	u = BSON_UINT32_FROM_LE(u);
+	memcpy(&f, &u, sizeof f);
+	return f;
+}
+
+static void setFloat(uint8_t *p, float f) {
+	uint32_t u;
+	memcpy(&u, &f, sizeof u);
+	u = BSON_UINT32_TO_LE(u);
+	memcpy(p, &u, sizeof u);
+}
+
+#define FLOATINT 16777216 /* Integers up to 2^24 are exact in float32 */
+
+static bool isFloat32(double x, bool exact) { /* Non-finite values are always representable */
+	if (x != x || x == HUGE_VAL || x == -HUGE_VAL) return true;
+	if (x < -FLT_MAX || x > FLT_MAX) return false;
+	return !exact || (double)(float)x == x;
+}
+
+static uint32_t getLength(const bson_value_t *val) {
+	const uint8_t *data = val->value.v_binary.data;
+	uint32_t len = val->value.v_binary.data_len - 2;
+	switch (data[0]) {
+		case VECTOR_FLOAT32:
+			return len / 4;
+		case VECTOR_PACKED_BIT:
+			return len * 8 - data[1];
+		default:
+			return len;
+	}
+}
+
+static void pushElement(lua_State *L, const bson_value_t *val, uint32_t i) {
+	const uint8_t *data = val->value.v_binary.data + 2;
+	switch (val->value.v_binary.data[0]) {
+		case VECTOR_FLOAT32:
+			lua_pushnumber(L, getFloat(data + i * 4));
+			break;
+		case VECTOR_INT8:
+			lua_pushinteger(L, (int8_t)data[i]);
+			break;
+		default:
+			lua_pushinteger(L, (data[i / 8] >> (7 - i % 8)) & 1);
+			break;
+	}
+}
+
+static int m_data(lua_State *L) {
+	bson_value_t *val = checkVector(L, 1);
+	lua_pushlstring(L, (const char *)val->value.v_binary.data + 2, val->value.v_binary.data_len - 2);
+	return 1;
+}
+
+static int m_unpack(lua_State *L) {
+	bson_value_t *val = checkVector(L, 1);
+	uint32_t i, n = getLength(val);
+	lua_pushstring(L, getTypeName(val->value.v_binary.data[0]));
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; ++i) {
+		pushElement(L, val, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 2;
+}
+
+static int m__index(lua_State *L) {
+	bson_value_t *val = checkVector(L, 1);
+	lua_Integer i;
+	if (lua_type(L, 2) != LUA_TNUMBER) { /* Method */
+		lua_getmetatable(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return 1;
+	}
+	i = lua_tointeger(L, 2);
+	if (i < 1 || i > getLength(val)) return 0;
+	pushElement(L, val, i - 1);
+	return 1;
+}
+
+static int m__tostring(lua_State *L) {
+	bson_value_t *val = checkVector(L, 1);
+	lua_pushfstring(L, TYPE_VECTOR "(\"%s\", %d)", getTypeName(val->value.v_binary.data[0]), (int)getLength(val));
+	return 1;
+}
+
+static int m__len(lua_State *L) {
+	lua_pushinteger(L, getLength(checkVector(L, 1)));
+	return 1;
+}
+
+static int m__eq(lua_State *L) {
+	bson_value_t *val1 = checkVector(L, 1);
+	bson_value_t *val2 = checkVector(L, 2);
+	uint32_t len = val1->value.v_binary.data_len;
+	lua_pushboolean(L, len == val2->value.v_binary.data_len && !memcmp(val1->value.v_binary.data, val2->value.v_binary.data, len));
+	return 1;
+}
+
+static const luaL_Reg funcs[] = {
+	{"data", m_data},
+	{"unpack", m_unpack},
+	{"__index", m__index},
+	{"__tostring", m__tostring},
+	{"__len", m__len},
+	{"__eq", m__eq},
+	{0, 0}
+};
+
+static uint32_t getSize(int type, uint32_t n) {
+	switch (type) {
+		case VECTOR_FLOAT32:
+			return n * 4;
+		case VECTOR_PACKED_BIT:
+			return (n + 7) / 8;
+		default:
+			return n;
+	}
+}
+
+static uint8_t *newVectorData(lua_State *L, int type, uint32_t n) {
+	uint32_t len = getSize(type, n) + 2;
+	bson_value_t *val = lua_newuserdata(L, sizeof *val + len);
+	uint8_t *data = (uint8_t *)(val + 1); /* Data is stored right after the value */
+	val->value_type = BSON_TYPE_BINARY;
+	val->value.v_binary.subtype = VECTOR_SUBTYPE;
+	val->value.v_binary.data = data;
+	val->value.v_binary.data_len = len;
+	memset(data, 0, len);
+	data[0] = type;
+	data[1] = type == VECTOR_PACKED_BIT ? (8 - n % 8) % 8 : 0; /* Padding */
+	setValueType(L, TYPE_VECTOR, BSON_TYPE_BINARY, funcs);
+	return data + 2;
+}
+
+int newVector(lua_State *L) {
+	int type = types[luaL_checkoption(L, 1, 0, names)];
+	uint32_t i, n;
+	uint8_t *data;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+	luaL_argcheck(L, getSize(type, n) <= INT32_MAX - 2, 2, "too many values");
+	data = newVectorData(L, type, n);
+	for (i = 0; i < n; ++i) {
+		lua_Integer k;
+		lua_rawgeti(L, 2, i + 1);
+		switch (type) {
+			case VECTOR_FLOAT32:
+				if (lua_type(L, -1) != LUA_TNUMBER) return argError(L, 2, "[%d] => number expected, got %s", i + 1, typeName(L, -1));
+				if (!isFloat32(lua_tonumber(L, -1), false)) return argError(L, 2, "[%d] => value out of float32 range", i + 1);
+				setFloat(data + i * 4, (float)lua_tonumber(L, -1));
+				break;
+			case VECTOR_INT8:
+				k = lua_tointeger(L, -1);
+				if (lua_type(L, -1) != LUA_TNUMBER || k != lua_tonumber(L, -1) || k < INT8_MIN || k > INT8_MAX) return argError(L, 2, "[%d] => Int8 expected, got %s", i + 1, typeName(L, -1));
+				data[i] = (uint8_t)(int8_t)k;
+				break;
+			default:
+				if (lua_toboolean(L, -1) && !(lua_type(L, -1) == LUA_TNUMBER && !lua_tonumber(L, -1))) data[i / 8] |= 0x80 >> i % 8;
+				break;
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+bool pushVector(lua_State *L, const uint8_t *data, uint32_t len) {
+	uint32_t n;
+	if (len < 2) return false;
+	n = len - 2;
+	switch (data[0]) {
+		case VECTOR_FLOAT32:
+			if (data[1] || n % 4) return false;
+			n /= 4;
+			break;
+		case VECTOR_INT8:
+			if (data[1]) return false;
+			break;
+		case VECTOR_PACKED_BIT:
+			if (data[1] > 7 || (!n && data[1])) return false;
+			n = n * 8 - data[1];
+			break;
+		default:
+			return false;
+	}
+	memcpy(newVectorData(L, data[0], n) - 2, data, len);
+	return true;
+}
+
+bool pushVectorFromArray(lua_State *L, const bson_iter_t *iter, int type) {
+	bson_iter_t tmp = *iter;
+	uint32_t i, n = 0;
+	int64_t k;
+	uint8_t *data;
+	while (bson_iter_next(&tmp)) { /* Check that all elements fit */
+		switch (bson_iter_type(&tmp)) {
+			case BSON_TYPE_INT32:
+			case BSON_TYPE_INT64:
+				k = bson_iter_as_int64(&tmp);
+				if (type == VECTOR_INT8 ? k < INT8_MIN || k > INT8_MAX : k < -FLOATINT || k > FLOATINT) return false;
+				break;
+			case BSON_TYPE_DOUBLE:
+				if (type == VECTOR_INT8 || !isFloat32(bson_iter_double(&tmp), true)) return false;
+				break;
+			default:
+				return false;
+		}
+		++n;
+	}
+	if (!n) return false;
+	tmp = *iter;
+	data = newVectorData(L, type, n);
+	for (i = 0; bson_iter_next(&tmp); ++i) {
+		if (type == VECTOR_FLOAT32) setFloat(data + i * 4, (float)bson_iter_as_double(&tmp));
+		else data[i] = (uint8_t)(int8_t)bson_iter_as_int64(&tmp);
+	}
+	return true;
+}
+
+int toVectorType(const char *name) {
+	int i;
+	for (i = 0; names[i]; ++i) {
+		if (!strcmp(name, names[i])) return types[i];
+	}
+	return 0;
+}
+
+bson_value_t *checkVector(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, TYPE_VECTOR);
+}
@@ -39,6 +39,49 @@ local b1 = BSON{a = 1, b = {__array = true, 1, 2, 3}}
 local b2 = BSON(b1:data())
 assert(b1 == b2)
 
+-- BSON(data, {borrow = true})
+local s = b1:data()
+local b = BSON(s, {borrow = true})
+assert(b == b1)
+assert(b:data() == s)
+test.equal(b:value(), b1:value())
+test.failure(b.append, b, 'a', 1) -- Read-only
+test.failure(b.concat, b, b1) -- Read-only
+test.failure(BSON, '{}', {borrow = true}) -- JSON
+test.failure(BSON, s:sub(1, -2), {borrow = true}) -- Invalid BSON
+
+-- BSON(value, {validate = level})
+assert(BSON({a = 'abc', ['b.c'] = 'ab\195\169\226\130\172\240\159\152\128'}, {validate = 'utf8'}))
+assert(BSON({a = '\255'}, {validate = 'none'}))
+test.failure(BSON, {a = '\255'}, {validate = true}) -- Invalid byte
+test.failure(BSON, {a = ('x'):rep(20) .. '\195'}, {validate = 'utf8'}) -- Truncated sequence
+test.failure(BSON, {a = '\192\128'}, {validate = 'utf8'}) -- Overlong encoding
+test.failure(BSON, {a = '\237\160\128'}, {validate = 'utf8'}) -- Surrogate
+test.failure(BSON, {a = {['\255'] = 1}}, {validate = 'utf8'}) -- Invalid key
+test.failure(BSON, {a = {['b.c'] = 1}}, {validate = 'keys'})
+test.failure(BSON, {['$a'] = 1}, {validate = 'keys'})
+test.failure(BSON, BSON{a = '\255'}:data(), {borrow = true, validate = 'utf8'})
+test.failure(BSON, {}, {validate = 'all'}) -- Invalid level
+assert(BSON{a = '\255'}:value(nil, {validate = 'none'}).a == '\255') -- Decoding
+test.failure(BSON{a = '\255'}.value, BSON{a = '\255'}, nil, {validate = true})
+test.failure(BSON{['$a'] = 1}.value, BSON{['$a'] = 1}, nil, mongo.UnpackOptions{validate = 'keys'})
+
+-- parseJSONBatch()
+local t = {}
+for i = 1, 100 do
+	t[i] = '{ "i" : ' .. i .. ' }'
+end
+local r = mongo.parseJSONBatch(t, {threads = 4})
+assert(#r == 100 and r[1] == BSON{i = 1} and r[100] == BSON{i = 100})
+local d = {}
+for i = 1, 100 do
+	d[i] = r[i]:data()
+end
+assert(mongo.parseJSONBatch(t, {raw = true}) == table.concat(d)) -- Contiguous buffer
+t[50] = 'abc'
+test.failure(mongo.parseJSONBatch, t, {threads = 2}) -- Invalid JSON
+test.failure(mongo.parseJSONBatch, {1}) -- Not a string
+
 -- bson:concat()
 local b1 = BSON{a = 1}
 local b2 = BSON{b = 2}
@@ -48,6 +91,51 @@ b1:concat(b2)
 testV(b1, '{ "a" : 1, "b" : 2, "b" : 2 }')
 test.failure(b1.concat, b1) -- Invalid value
 
+-- bson:beginDocument(), bson:beginArray()
+local b = BSON{}
+b:appendUtf8('s', 'abc')
+b:beginArray('a')
+b:appendInt32(nil, 1)
+b:append(nil, {x = 2})
+b:beginDocument()
+b:appendDouble('d', 0.5)
+b:appendBool('t', true)
+b:appendNull('n')
+b:endDocument()
+b:endArray()
+test.failure(b.endArray, b) -- No open array
+b:beginDocument('d')
+test.failure(BSON, b) -- Incomplete document
+test.failure(b.append, b, 'f', function () end) -- Invalid value (document is kept intact)
+b:appendInt64('i', 1)
+b:endDocument()
+testV(b, '{ "s" : "abc", "a" : [ 1, { "x" : 2 }, { "d" : 0.5, "t" : true, "n" : null } ], "d" : { "i" : { "$numberLong" : "1" } } }')
+
+-- bson:view()
+local b = BSON{a = 1, b = {c = {1, 2, {d = 'x'}}}, e = mongo.Int64(5)}
+local v = b:view()
+b:append('f', 1) -- View is not affected
+assert(v.a == 1 and v.f == nil and v.e == mongo.Int64(5))
+assert(mongo.type(v.b) == 'mongo.BSONView')
+assert(rawequal(v.b, v.b)) -- Cached subview
+assert(#v.b.c == 3 and v.b.c[3].d == 'x' and v.b.c[4] == nil and v.b.c.x == nil)
+assert(BSON(v.b) == BSON{c = {1, 2, {d = 'x'}}})
+if _VERSION ~= 'Lua 5.1' then
+	local n = 0
+	for k, x in pairs(v.b.c) do
+		n = n + 1
+		assert(k == n)
+	end
+	assert(n == 3)
+end
+local n = 0
+for k, x in v:pairs() do -- Works on all Lua versions
+	n = n + 1
+	assert(k == 'a' and x == 1 or k == 'b' and mongo.type(x) == 'mongo.BSONView' or k == 'e')
+end
+assert(n == 3)
+assert(rawequal(select(2, v.b:pairs()(v.b)), v.b.c)) -- Iterator returns cached subviews
+
 -- bson:find()
 local b = BSON{a = {b = mongo.Null}}
 assert(b:find('') == nil)
@@ -130,6 +218,18 @@ testV({a = mongo.MaxKey}, '{ "a" : { "$maxKey" : 1 } }')
 testV({a = mongo.MinKey}, '{ "a" : { "$minKey" : 1 } }')
 testV({a = mongo.Null}, '{ "a" : null }')
 
+local v = BSON{a = mongo.Decimal128('1.5'), b = mongo.Binary('abc', 0x80), c = mongo.Regex('abc', 'i'), d = mongo.DateTime(1), t = mongo.Timestamp(1, 2)}:value()
+assert(v.a == mongo.Decimal128('1.5'))
+assert(v.b == mongo.Binary('abc', 0x80))
+assert(v.b ~= mongo.Binary('abc'))
+assert(v.c == mongo.Regex('abc', 'i'))
+assert(v.d == mongo.DateTime(1))
+assert(v.d ~= mongo.Int64(1))
+assert(v.t == mongo.Timestamp(1, 2))
+assert(select('#', v.b:unpack()) == 2)
+assert(tostring(v.b) == 'mongo.Binary("abc", 128)')
+assert(mongo.type(v.d) == 'mongo.DateTime')
+
 
 -- Handlers
 
@@ -143,6 +243,340 @@ testX(obj, h1) -- Root transition
 testX({a = obj}, h2) -- Nested transition
 
 
+-- Schema
+
+local Point = mongo.Schema{{'x', 'double'}, {'y', 'double'}}
+local Item = mongo.Schema{'_id', {'name', 'string'}, {'qty', 'int32'}, {'tags', 'array'}, {'pos', Point}}
+local ItemClass = {__toBSON = Item}
+assert(#Item == 5)
+test.equal(Item:fields(), {'_id', 'name', 'qty', 'tags', 'pos'})
+testV(Item{_id = 1, name = 'abc', qty = 2, tags = {'a'}, pos = {x = 1, y = 2}, tmp = 3}, '{ "_id" : 1, "name" : "abc", "qty" : 2, "tags" : [ "a" ], "pos" : { "x" : 1.0, "y" : 2.0 } }')
+testV(setmetatable({name = 'abc'}, ItemClass), '{ "name" : "abc" }') -- Root schema as '__toBSON'
+testV({a = setmetatable({qty = 1}, ItemClass)}, '{ "a" : { "qty" : 1 } }') -- Nested schema as '__toBSON'
+test.failure(Item, {name = 1}) -- Invalid type
+test.failure(Item, {qty = 2147483648}) -- Int32 overflow
+test.failure(Item, {pos = 1}) -- Nested schema expects a table
+test.failure(mongo.Schema, {{'a', 'abc'}}) -- Invalid type name
+test.failure(mongo.Schema, {1}) -- Invalid key
+local field = {'age', 'int32'}
+local Person = mongo.Schema{field}
+field[1] = 'other' -- Key is copied into schema
+test.equal(Person:fields(), {'age'})
+assert(Person{age = 30}:data() == BSON{age = mongo.Int32(30)}:data())
+test.failure(Person, {age = 1.5}) -- Typed scalar field
+local Event = mongo.Schema{{'n', 'int64'}, {'d', 'double'}, {'t', 'datetime'}, {'i', 'int32'}}
+local e = {n = mongo.Int64(5), d = mongo.Double(1), t = mongo.DateTime(1000), i = mongo.Int32(7)}
+assert(Event(e) == BSON'{"n":{"$numberLong":"5"},"d":{"$numberDouble":"1"},"t":{"$date":{"$numberLong":"1000"}},"i":7}') -- BSON type instances
+test.failure(Event, {t = mongo.Int64(1000)}) -- Mismatched BSON type
+
+
+-- BSONWriter
+
+local w = mongo.BSONWriter(256, true)
+local b1 = w:encode{a = 1, b = {1, 2, 3}}
+assert(b1 == BSON{a = 1, b = {1, 2, 3}})
+local b2 = w:encode(Item{name = 'abc'})
+assert(rawequal(b1, b2)) -- Same document is reused
+assert(b2 == BSON{name = 'abc'})
+test.failure(w.encode, w, {a = function () end}) -- Invalid value
+assert(w:encode{a = 'abc'} == BSON{a = 'abc'}) -- Writer is usable after failure
+local s = w:stats()
+assert(s.count == 3)
+assert(s.size >= 256)
+assert(s.estimatedGrows == 0)
+w = mongo.BSONWriter(0, false, {validate = 'keys'})
+test.failure(w.encode, w, {['a.b'] = 1})
+assert(w:encode{a = 1} == BSON{a = 1})
+assert(w:stats().count == 1 and w:stats().validateSeconds >= 0)
+
+
+-- Vector
+
+local v = mongo.Vector('float32', {0.5, 1.5, -2})
+assert(#v == 3 and v[1] == 0.5 and v[3] == -2 and v[4] == nil)
+testV({v = v}, '{ "v" : { "$binary" : "JwAAAAA/AADAPwAAAMA=", "$type" : "09" } }')
+assert(BSON{v = v}:value(nil, {vectors = true}).v == v)
+assert(mongo.type(BSON{v = v}:value().v) == 'mongo.Binary') -- Vectors are not unpacked by default
+local v = mongo.Vector('packed_bit', {1, 0, 1})
+assert(#v == 3 and v[1] == 1 and v[2] == 0 and v:data() == '\160')
+test.equal({v:unpack()}, {'packed_bit', {1, 0, 1}})
+local t = BSON{a = {1, 2, -3}, b = {1, 'x'}, c = {1000}}:value(nil, {numericArrays = 'int8'})
+assert(t.a == mongo.Vector('int8', {1, 2, -3}))
+assert(type(t.b) == 'table') -- Non-numeric array
+assert(type(t.c) == 'table') -- Out of range
+test.failure(mongo.Vector, 'int8', {128}) -- Out of range
+test.failure(mongo.Vector, 'float32', {'a'}) -- Not a number
+test.failure(mongo.Vector, 'float32', {1e300}) -- Out of range
+assert(mongo.Vector('float32', {0.1, 1 / 0})[2] == 1 / 0) -- Rounded, infinity is kept
+t = BSON{a = {0.5, 2}, b = {0.1}, c = {1e300}, d = {2 ^ 30 + 1}}:value(nil, {numericArrays = 'float32'})
+assert(t.a == mongo.Vector('float32', {0.5, 2}))
+assert(type(t.b) == 'table' and type(t.c) == 'table' and type(t.d) == 'table') -- Inexact
+test.failure(mongo.Vector, 'abc', {}) -- Invalid type
+test.failure(BSON{}.value, BSON{}, nil, {numericArrays = 'abc'}) -- Invalid option
+
+
+-- Projection
+
+local b = BSON{a = 1, b = {c = 2, d = 3}, e = 4, items = {{sku = 'x', qty = 1}, {sku = 'y'}, 5}}
+test.equal(b:value(nil, {fields = {'a', 'b.c', 'items.$.sku'}}), {a = 1, b = {c = 2}, items = {__array = 3, {sku = 'x'}, {sku = 'y'}}})
+test.equal(b:value(nil, {fields = {'b', 'b.c'}}), {b = {c = 2, d = 3}}) -- Whole subtree
+test.equal(b:value(nil, {fields = {'a.x', 'items.2'}}), {items = {__array = 3, [2] = {sku = 'y'}}}) -- Scalars are not descended into
+test.equal(b:value(nil, {fields = {}}), {})
+test.failure(BSON{}.value, BSON{}, nil, {fields = {'a..b'}}) -- Empty path component
+test.failure(BSON{}.value, BSON{}, nil, {fields = 'a'}) -- Not a table
+
+
+-- Decode profiles
+
+local oid = mongo.ObjectID('000102030405060708090a0b')
+local b = BSON{d = mongo.DateTime(1234), t = mongo.Timestamp(1, 2), x = mongo.Binary('abc'), n = mongo.Decimal128('1.5'), o = oid, a = {1}}
+test.equal(b:value(nil, {profile = 'raw'}), {d = 1234, t = 4294967298, x = 'abc', n = '1.5', o = oid:data(), a = {1}})
+local t = b:value(nil, {profile = 'raw', objectIds = 'hex', dates = 'default', arrayLength = true})
+assert(t.o == '000102030405060708090a0b' and t.d == mongo.DateTime(1234) and t.a.__array == 1)
+test.failure(BSON{}.value, BSON{}, nil, {profile = 'abc'}) -- Invalid profile
+test.failure(BSON{}.value, BSON{}, nil, {dates = 'string'}) -- Invalid option
+local opts = {objectIds = 'hex'}
+local compiled = mongo.UnpackOptions(opts)
+assert(mongo.type(compiled) == 'mongo.UnpackOptions')
+assert(b:value(nil, opts).o == '000102030405060708090a0b')
+opts.objectIds = 'bytes' -- Plain tables are compiled on every call
+assert(b:value(nil, opts).o == oid:data())
+assert(b:value(nil, compiled).o == '000102030405060708090a0b')
+test.failure(mongo.UnpackOptions, {dates = 'string'})
+compiled = mongo.UnpackOptions{fields = {'o', 'a'}, objectIds = 'hex', arrayLength = false}
+assert(mongo.type(compiled) == 'mongo.UnpackOptions')
+test.equal(b:value(nil, compiled), {o = '000102030405060708090a0b', a = {1}})
+test.equal(b:value(nil, compiled), {o = '000102030405060708090a0b', a = {1}}) -- Reused
+
+
+-- Unpack into existing tables
+
+local t = {x = 1, a = {b = 1, c = 2}, d = {1, 2, 3}}
+local a, d = t.a, t.d
+local opts = {into = t}
+assert(BSON{a = {b = 3}, d = {4}}:value(nil, opts) == t)
+test.equal(t, {a = {b = 3}, d = {__array = 1, 4}})
+assert(t.a == a and t.d == d) -- Nested tables are reused
+assert(BSON{a = 'abc'}:value(nil, opts) == t)
+test.equal(t, {a = 'abc'})
+assert(BSON{a = {1, 2}}:value(nil, {into = t, fields = {'a.2'}, arrayLength = false}).a[2] == 2)
+test.failure(BSON{}.value, BSON{}, nil, {into = 'abc'}) -- Not a table
+
+
+-- Handler map
+
+local n = 0
+local function item(t) n = n + 1 return {sku = t.sku:upper()} end
+local b = BSON{items = {{sku = 'a'}, {sku = 'b'}}, meta = {x = 1}, x = 1}
+local t = b:value(nil, {handlers = {['items.*'] = item, meta = false, x = tostring, [''] = function (t) t.root = true return t end}})
+test.equal(t, {items = {__array = 2, {sku = 'A'}, {sku = 'B'}}, x = '1', root = true})
+assert(n == 2)
+test.failure(BSON{}.value, BSON{}, nil, {handlers = {a = 1}}) -- Invalid handler
+test.failure(BSON{}.value, BSON{}, nil, {handlers = {a = setmetatable({}, {__call = 1})}}) -- Invalid '__call'
+local scale = setmetatable({k = 10}, {__call = function (self, v) return v * self.k end})
+t = BSON{a = 1, b = 2}:value(nil, {handlers = {a = scale, b = scale}}) -- Callable object
+assert(t.a == 10 and t.b == 20)
+test.failure(BSON{}.value, BSON{}, nil, {handlers = {[''] = false}}) -- Root can't be skipped
+
+
+-- BSONReader
+
+local name = os.tmpname()
+local f = assert(io.open(name, 'wb'))
+for i = 1, 10 do
+	f:write(BSON{i = i, s = {x = i}}:data())
+end
+f:close()
+local r = assert(mongo.BSONReader(name))
+local v = r:next()
+assert(mongo.type(v) == 'mongo.BSONView' and v.i == 1 and v.s.x == 1)
+assert(r:value().i == 2)
+local n = 0
+for t in r:iterator(nil, {fields = {'i'}}) do
+	n = n + 1
+	assert(t.i == n + 2 and t.s == nil)
+end
+assert(n == 8 and r:next() == nil)
+local parts = assert(mongo.BSONReader(name)):split(3)
+n = 0
+for _, p in ipairs(parts) do
+	for t in p:iterator() do
+		n = n + t.i
+	end
+end
+assert(n == 55 and #parts == 3)
+local s, e = parts[2]:range()
+assert(mongo.BSONReader(name, {offset = s, length = e - s}):value().i == parts[2]:value().i)
+f = assert(io.open(name, 'ab'))
+f:write('abcdef')
+f:close()
+r = assert(mongo.BSONReader(name, {offset = s}))
+for t in r.next, r do end
+test.error(r:next()) -- Garbage at the end
+test.failure(r.value, r)
+os.remove(name)
+assert(not mongo.BSONReader(name)) -- No such file
+
+
+-- BSONFileWriter
+
+local w = assert(mongo.BSONFileWriter(name, {bufferSize = 64}))
+for i = 1, 10 do
+	assert(w:write{i = i, s = ('x'):rep(i)})
+end
+assert(w:write(BSON{i = 11}))
+test.failure(w.write, w, {a = setmetatable({}, {})}) -- Invalid value
+assert(w:stats().count == 11)
+assert(w:sync())
+assert(w:close())
+test.failure(w.write, w, {}) -- Closed
+w = assert(mongo.BSONFileWriter(name, {append = true}))
+assert(w:write{i = 12})
+assert(w:close())
+r = assert(mongo.BSONReader(name, {validate = true}))
+n = 0
+for t in r:iterator() do
+	n = n + 1
+	assert(t.i == n)
+end
+assert(n == 12)
+w = assert(mongo.BSONFileWriter(name, {validate = true}))
+test.failure(w.write, w, {s = '\255'})
+assert(w:write{s = 'abc'})
+assert(w:stats().count == 1)
+assert(w:close())
+w = assert(mongo.BSONFileWriter(name, {append = true}))
+assert(w:write{s = '\255'})
+assert(w:close())
+r = assert(mongo.BSONReader(name, {validate = 'utf8'}))
+assert(r:value().s == 'abc')
+test.error(r:value()) -- Invalid UTF-8
+r = assert(mongo.BSONReader(name, {validate = true})) -- Same as 'utf8'
+assert(r:value().s == 'abc')
+test.error(r:value())
+r = assert(mongo.BSONReader(name))
+assert(r:value().s == 'abc')
+test.failure(r.value, r, nil, {validate = 'utf8'}) -- Checked when decoding
+test.failure(mongo.BSONReader, name, {validate = 'all'})
+os.remove(name)
+
+
+-- Extended JSON
+
+local oid = '{"$oid":"0123456789abcdef01234567"}'
+assert(mongo.toJSON{a = 1} == '{"a":1}')
+assert(mongo.toJSON({a = 1}, {mode = 'canonical'}) == '{"a":{"$numberInt":"1"}}')
+assert(mongo.toJSON({a = 1.5}, {mode = 'canonical'}) == '{"a":{"$numberDouble":"1.5"}}')
+assert(mongo.toJSON{a = 'x"\\\n\1y'} == '{"a":"x\\"\\\\\\n\\u0001y"}')
+assert(mongo.toJSON{a = mongo.DateTime(1000)} == '{"a":{"$date":"1970-01-01T00:00:01Z"}}')
+assert(mongo.toJSON{a = mongo.DateTime(-1)} == '{"a":{"$date":{"$numberLong":"-1"}}}')
+assert(mongo.toJSON{a = mongo.Binary('abcd', 0x80)} == '{"a":{"$binary":{"base64":"YWJjZA==","subType":"80"}}}')
+assert(mongo.toJSON(BSON{a = {__array = true, 1, 2, BSON'{"b":[]}'}}) == '{"a":[1,2,{"b":[]}]}')
+assert(mongo.toJSON(BSON{a = {b = 1}}:view().a) == '{"b":1}')
+assert(mongo.toJSON(BSON'{"0":"a","b":1}') == '{"0":"a","b":1}') -- Document is always an object
+assert(mongo.toJSON(BSON{__array = true}) == '{}')
+assert(mongo.toJSON{__array = true, 1, 2} == '[1,2]') -- Table is converted as a value
+assert(mongo.toJSON('a"b') == '"a\\"b"' and mongo.toJSON(1.5) == '1.5' and mongo.toJSON(nil) == 'null')
+assert(mongo.toJSON(mongo.Int64(5), {mode = 'canonical'}) == '{"$numberLong":"5"}')
+test.failure(mongo.toJSON, {}, {mode = 'abc'}) -- Invalid mode
+local t = mongo.fromJSON('{"a": [1, 2.5, "x\\u00e9\\ud83d\\ude00", true, null], "b": {"c": {}}}')
+assert(t.a.__array == 5 and t.a[1] == 1 and t.a[2] == 2.5 and t.a[3] == 'x\195\169\240\159\152\128' and t.a[4] == true and t.a[5] == mongo.Null)
+assert(next(t.b.c) == nil)
+assert(mongo.fromJSON('{"a":' .. oid .. '}').a == mongo.ObjectID('0123456789abcdef01234567'))
+assert(mongo.fromJSON('{"$numberLong":"42"}') == 42)
+assert(mongo.type(mongo.fromJSON('{"$date":{"$numberLong":"1000"}}')) == 'mongo.DateTime')
+assert(mongo.fromJSON('{"$gt":1}')['$gt'] == 1) -- Not a wrapper
+local s = '{"a":{"b":[1,{"c":"d"}]},"e":{"$oid":"0123456789abcdef01234567"},"f":{"$minKey":1}}'
+test.equal(mongo.fromJSON(s), BSON(s):value())
+s = '{"a":[1,{"b":{"$timestamp":{"t":1,"i":2}}},{"$numberDecimal":"1.5"}]}'
+assert(mongo.toJSON(mongo.fromJSON(s)) == s) -- Round trip
+test.failure(mongo.fromJSON, '{"a":}') -- Missing value
+test.failure(mongo.fromJSON, '[1, 2') -- Unterminated array
+test.failure(mongo.fromJSON, '"\\x"') -- Invalid escape
+test.failure(mongo.fromJSON, '1 2') -- Trailing characters
+test.failure(mongo.fromJSON, ('['):rep(1000)) -- Too deep
+
+
+-- MessagePack/CBOR
+
+assert(BSON{a = 1}:toMsgPack() == '\129\161a\1')
+assert(BSON{a = 1}:toCBOR() == '\161\97\1')
+assert(BSON{a = {__array = true, -1, 1.5, 'x'}}:toCBOR() == '\161\97\131\32\251\63\248\0\0\0\0\0\0\97x')
+local b = BSON[[{
+	"i": 1, "l": {"$numberLong": "5000000000"}, "n": -200, "d": 1.5, "s": "abc", "t": true, "z": null,
+	"a": [1, {"x": []}], "o": {"$oid": "0123456789abcdef01234567"},
+	"b0": {"$binary": {"base64": "YWJj", "subType": "00"}}, "b4": {"$binary": {"base64": "YWJj", "subType": "04"}},
+	"dt": {"$date": {"$numberLong": "1500"}}, "dn": {"$date": {"$numberLong": "-1"}}, "ds": {"$date": {"$numberLong": "3000"}},
+	"r": {"$regularExpression": {"pattern": "^a", "options": "i"}}, "ts": {"$timestamp": {"t": 1, "i": 2}},
+	"dec": {"$numberDecimal": "1.5"}, "min": {"$minKey": 1}, "max": {"$maxKey": 1},
+	"c": {"$code": "f()"}, "cs": {"$code": "g()", "$scope": {"v": 1}}, "sym": {"$symbol": "s"}, "u": {"$undefined": true}
+}]]
+assert(mongo.fromMsgPack(b:toMsgPack()) == b) -- Round trip
+assert(#b:toCBOR() > 0)
+assert(mongo.fromMsgPack('\146\1\2'):data() == BSON{__array = 2, 1, 2}:data()) -- Root array
+test.failure(mongo.fromMsgPack, '\1') -- Not a map
+test.failure(mongo.fromMsgPack, '\129\1\1') -- Non-string key
+test.failure(mongo.fromMsgPack, '\129\161a') -- Truncated
+test.failure(mongo.fromMsgPack, '\129\161a\1\1') -- Trailing data
+test.failure(mongo.fromMsgPack, '\129\161a\212\99\0') -- Unsupported extension
+assert(mongo.fromMsgPack('\129\161a\161\255'):value().a == '\255')
+test.failure(mongo.fromMsgPack, '\129\161a\161\255', {validate = true}) -- Invalid UTF-8
+test.failure(mongo.fromMsgPack, '\129\161$\1', {validate = 'keys'})
+
+
+-- Compression
+
+local b = BSON{s = ('abc'):rep(100), i = 1}
+if pcall(b.compress, b) then -- Built with zstd
+	local s = b:compress()
+	assert(#s < #b and mongo.decompress(s) == b)
+	assert(mongo.decompress(b:compress{codec = 'zstd', level = 19}) == b)
+	local t = {}
+	for i = 1, 1000 do
+		t[i] = {i = i, name = 'item' .. i, tags = {__array = true, 'red', 'green'}}
+	end
+	local dict = assert(mongo.trainDictionary(t, 4096))
+	s = BSON(t[1]):compress{dict = dict}
+	assert(mongo.type(dict) == 'mongo.Dictionary' and #dict == #dict:data())
+	assert(mongo.decompress(s, {dict = dict}) == BSON(t[1]))
+	assert(mongo.decompress(BSON(t[2]):compress{dict = dict, level = 9}, {dict = dict}) == BSON(t[2])) -- Reused
+	assert(mongo.decompress(s, {dict = dict:data()}) == BSON(t[1])) -- Raw data
+	assert(mongo.decompress(s, {dict = mongo.Dictionary(dict:data())}) == BSON(t[1]))
+	test.failure(mongo.decompress, s) -- Missing dictionary
+	test.failure(mongo.decompress, 'abc') -- Not compressed
+	test.failure(mongo.decompress, b:compress(), {maxSize = #b - 1}) -- Too large
+	test.failure(mongo.decompress, b:compress(), {maxSize = 0})
+	test.failure(mongo.Dictionary, '')
+	test.failure(b.compress, b, {codec = 'lz4'})
+	test.failure(b.compress, b, {level = 1000})
+	test.failure(mongo.trainDictionary, {})
+else
+	test.failure(mongo.decompress, 'abc') -- Not supported
+end
+
+
+-- Path
+
+local p = mongo.Path('a.b')
+local b = BSON{a = {b = {c = 1, d = {2, 3}}}, x = 1}
+assert(p:get(b).c == 1 and p:get(b).d[2] == 3)
+assert(mongo.Path('a.b.d.1'):get(b) == 3)
+assert(mongo.Path('a.b.c'):get(b:view()) == 1)
+assert(mongo.Path('x.y'):get(b) == nil) -- Not a document
+assert(mongo.Path('y'):get(b) == nil) -- Not found
+local t = mongo.Path('x'):getMany{b, BSON{}, BSON{x = 2}}
+assert(t[1] == 1 and t[2] == nil and t[3] == 2)
+local v = p:get(b)
+b:append('y', 1) -- Document stays writable, view refers to a copy
+assert(v.c == 1 and mongo.Path('y'):get(b) == 1)
+local w = mongo.BSONWriter()
+v = mongo.Path('a'):get(w:encode{a = {b = 1}})
+w:encode{a = {b = 2}} -- Writer's document is reused
+assert(v.b == 1)
+test.failure(mongo.Path, 'a..b') -- Empty segment
+test.failure(p.get, p, {}) -- Not a document
+
+
 -- Errors
 
 testF(setmetatable({}, {})) -- Table with metatable
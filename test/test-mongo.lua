@@ -62,8 +62,74 @@ assert(i(s) == nil) -- No more items
 test.failure(i, s) -- Exception is thrown
 i, s = collection:find({_id = 123}):iterator(function (t) return {id = t._id} end) -- With transformation
 assert(i(s).id == 123)
+i, s = collection:find({_id = 123}):iterator(nil, {fields = {'_id'}}) -- Selected fields
+test.equal(i(s), {_id = 123})
 collectgarbage()
 
+-- cursor:columns()
+local c, n = collection:find({}, {sort = {_id = 1}}):columns({'_id', 'a.b'}, {types = {['a.b'] = 'string'}})
+assert(n == 3 and #c._id == 3 and #c['a.b'] == 3)
+assert(c._id:type() == 'int64' and c._id[1] == 123 and c._id[3] == 789)
+assert(c['a.b']:type() == 'string' and c['a.b'][1] == nil and c['a.b']:validity() == '\0') -- All nulls
+c, n = collection:find({}, {sort = {_id = 1}}):columns({'_id'}, {limit = 2})
+assert(n == 2 and #c._id == 2)
+test.failure(collection:find{}.columns, collection:find{}, {'_id', '_id'}) -- Duplicate field
+test.failure(collection:find{}.columns, collection:find{}, {'_id'}, {limit = 'x'}) -- Invalid limit
+collectgarbage()
+
+-- cursor:next(true)
+cursor = collection:find({}, {sort = {_id = 1}})
+local v1 = cursor:next(true)
+assert(mongo.type(v1) == 'mongo.BSONView' and v1._id == 123)
+local c1 = v1:copy()
+local v2 = cursor:next(true)
+assert(v1 == v2 and v2._id == 456) -- View is reused
+assert(cursor:value()._id == 789)
+test.failure(function () return v2._id end) -- Invalidated by advancing the cursor
+assert(c1._id == 123) -- Copy stays valid
+assert(cursor:next(true) == nil)
+collectgarbage()
+
+-- cursor:toJSON(), cursor:writeJSON()
+local opts = {sort = {_id = 1}, projection = {_id = 1}}
+local str, n = collection:find({}, opts):toJSON()
+assert(str == '[{"_id":123},{"_id":456},{"_id":789}]' and n == 3)
+cursor = collection:find({}, opts)
+str, n = cursor:toJSON{maxBytes = 1, mode = 'canonical'}
+assert(str == '[{"_id":{"$numberInt":"123"}}]' and n == 1) -- Stops at document boundary
+assert(cursor:toJSON() == '[{"_id":456},{"_id":789}]')
+assert(cursor:toJSON() == '[]')
+local chunks = {}
+assert(collection:find({}, opts):writeJSON(function (s) chunks[#chunks + 1] = s end, 16) == 3)
+assert(#chunks == 2 and table.concat(chunks) == '[{"_id":123},{"_id":456},{"_id":789}]')
+test.failure(collection:find{}.writeJSON, collection:find{}, print, 0) -- Invalid chunk size
+collectgarbage()
+
+-- cursor:compress()
+if pcall(mongo.BSON{}.compress, mongo.BSON{}) then -- Built with zstd
+	local blob, n = collection:find({}, opts):compress{level = 9}
+	local t = mongo.decompress(blob):value()
+	assert(n == 3 and t[1]._id == 123 and t[3]._id == 789)
+	cursor = collection:find({}, opts)
+	blob, n = cursor:compress{maxBytes = 1}
+	assert(n == 1 and mongo.decompress(blob):value()[1]._id == 123)
+	assert(select(2, cursor:compress()) == 2)
+	blob, n = collection:find({}, opts):compress() -- No options
+	assert(n == 3 and mongo.decompress(blob):value()[2]._id == 456)
+	local dict = mongo.Dictionary(tostring(mongo.BSON{_id = 123}):rep(10)) -- Raw content dictionary
+	blob = collection:find({}, opts):compress{dict = dict}
+	assert(mongo.decompress(blob, {dict = dict}):value()[3]._id == 789)
+end
+collectgarbage()
+
+-- BSONFileWriter:writeCursor()
+local w = assert(mongo.BSONFileWriter(test.filename))
+assert(w:writeCursor(collection:find{}) == 3)
+assert(w:close())
+local r = assert(mongo.BSONReader(test.filename))
+assert(r:value()._id and r:value()._id and r:value()._id and r:value() == nil)
+os.remove(test.filename)
+
 assert(collection:remove({}, {single = true})) -- Flags
 assert(collection:count{} == 2)
 assert(collection:remove{_id = 123})
@@ -84,7 +150,7 @@ local t = {}
 for i = 1, 100 do
 	t[#t + 1] = {a = 1}
 end
-test.failure(collection.insertMany, collection, (table.unpack or unpack)(t)) -- Too many documents
+assert(collection:insertMany((table.unpack or unpack)(t))) -- Number of documents is not limited
 test.error(collection:insertMany()) -- Empty insert
 test.error(collection:insertMany({_id = 123}, {_id = 456})) -- Duplicate key
 collection:drop()
@@ -104,6 +170,69 @@ assert(cursor:value().b == 1)
 assert(cursor:value().b == 1)
 assert(cursor:value() == nil)
 
+-- collection:importJSONLines()
+collection:drop()
+local f = assert(io.open(test.filename, 'w'))
+for i = 1, 25 do
+	f:write('{"_id": ', i, '}\n', i % 10 == 0 and '\n' or '')
+end
+f:close()
+local stats = assert(collection:importJSONLines(test.filename, {batchSize = 10, parseThreads = 2, writeConcern = {w = 1}}))
+assert(stats.documents == 25 and stats.batches == 3 and stats.lines == 27)
+assert(collection:count{} == 25)
+f = assert(io.open(test.filename, 'w'))
+f:write('{"_id": 100}\n{"_id": 101}\n{"_id":\n{"_id": 102}\n')
+f:close()
+local r, e, stats = collection:importJSONLines(test.filename)
+assert(r == nil and e:find(':3:') and stats.documents == 2) -- Invalid JSON on line 3
+r, e, stats = collection:importJSONLines(test.filename, {ordered = false})
+assert(r == nil and stats.documents == 0) -- Duplicate keys
+os.remove(test.filename)
+test.error(collection:importJSONLines(test.filename)) -- No such file
+test.failure(collection.importJSONLines, collection, test.filename, {batchSize = 0})
+
+-- collection:exportTo()
+collection:drop()
+assert(collection:insertMany({_id = 1, a = 1}, {_id = 2, a = 2}, {_id = 3, a = 3}))
+stats = assert(collection:exportTo(test.filename, {query = {a = {['$gt'] = 1}}, batchSize = 1}))
+assert(stats.documents == 2 and stats.bytes == #mongo.BSON{_id = 2, a = 2} * 2)
+r = assert(mongo.BSONReader(test.filename))
+assert(r:value()._id == 2 and r:value()._id == 3 and r:value() == nil)
+stats = assert(collection:exportTo(test.filename, {format = 'jsonl', projection = {a = 0}}))
+f = assert(io.open(test.filename))
+assert(f:read('*a') == '{"_id":1}\n{"_id":2}\n{"_id":3}\n' and stats.documents == 3)
+f:close()
+collection:drop()
+assert(collection:importJSONLines(test.filename).documents == 3) -- Round trip
+os.remove(test.filename)
+test.failure(collection.exportTo, collection, test.filename, {format = 'xml'})
+
+-- collection:importBSON()
+collection:drop()
+assert(collection:insertMany({_id = 1}, {_id = 2}, {_id = 3}, {_id = 4}, {_id = 5}))
+assert(collection:exportTo(test.filename))
+collection:drop()
+stats = assert(collection:importBSON(test.filename, {batchSize = 2, numInsertionWorkers = 2}))
+assert(stats.documents == 5 and stats.batches == 3 and stats.bytes == #mongo.BSON{_id = 1} * 5)
+assert(collection:count{} == 5)
+r, e, stats = collection:importBSON(mongo.BSONReader(test.filename)) -- Duplicate keys
+assert(r == nil and stats.documents == 0 and #stats.errors == 1)
+assert(collection:remove{_id = {['$in'] = {1, 4}}})
+r, e, stats = collection:importBSON(test.filename, {batchSize = 1, ordered = false}) -- Keep going
+assert(r == nil and stats.documents == 2 and #stats.errors == 3)
+collection:drop()
+f = assert(io.open(test.filename, 'ab'))
+f:write('\1\0\0\0') -- Truncated document
+f:close()
+r, e, stats = collection:importBSON(test.filename, {batchSize = 1})
+assert(r == nil and stats.documents == 5 and collection:count{} == 5)
+assert(io.open(test.filename, 'wb')):close()
+stats = assert(collection:importBSON(test.filename)) -- Empty dump
+assert(stats.documents == 0 and stats.batches == 0)
+os.remove(test.filename)
+test.error(collection:importBSON(test.filename)) -- No such file
+test.failure(collection.importBSON, collection, test.filename, {numInsertionWorkers = 0})
+
 -- Bulk operation
 local function bulkInsert(ordered, n)
 	collection:drop()